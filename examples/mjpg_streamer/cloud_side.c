@@ -74,6 +74,7 @@ static void cb(struct ns_connection *nc, int ev, void *ev_data) {
 
 int main(int argc, char *argv[]) {
   struct ns_mgr mgr;
+  struct ns_connection *nc;
 
   if (argc != 2) {
     fprintf(stderr, "Usage: %s <listening_addr>\n", argv[0]);
@@ -88,11 +89,14 @@ int main(int argc, char *argv[]) {
 
   ns_mgr_init(&mgr, NULL);
 
-  if (ns_bind_http(&mgr, argv[1], cb, NULL) == NULL) {
+  if ((nc = ns_bind_http(&mgr, argv[1], cb, NULL)) == NULL) {
     fprintf(stderr, "Error binding to %s\n", argv[1]);
     exit(EXIT_FAILURE);
   }
 
+  // Drop devices that went away silently, e.g. behind a NAT
+  ns_set_websocket_keepalive(nc, 30, 3);
+
   while (s_received_signal == 0) {
     ns_mgr_poll(&mgr, 1000);
   }
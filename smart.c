@@ -33,15 +33,186 @@
 #define NS_UDP_RECEIVE_BUFFER_SIZE  2000
 #define NS_VPRINTF_BUFFER_SIZE      500
 
-struct ctl_msg {
-  ns_callback_t callback;
-  char message[1024 * 8];
-};
+#ifndef NS_BUF_POOL_MAX_FREE_BYTES
+#define NS_BUF_POOL_MAX_FREE_BYTES  (4 * 1024 * 1024)   // Per size class
+#endif
+
+#ifndef NS_ACCEPT_BUDGET
+#define NS_ACCEPT_BUDGET            64    // Default ns_mgr::accept_budget
+#endif
+
+// eCos does not respect the non-blocking flag on a listening socket, and
+// a loop over accept() hangs there. Accept one connection per poll instead.
+#if defined(__ECOS) && !defined(NS_ACCEPT_ONE_PER_POLL)
+#define NS_ACCEPT_ONE_PER_POLL
+#endif
+
+#ifndef NS_UDP_BATCH_SIZE
+#define NS_UDP_BATCH_SIZE           16    // Datagrams per recvmmsg/sendmmsg
+#endif
+
+#ifndef NS_UDP_GRO_BATCH_SIZE
+#define NS_UDP_GRO_BATCH_SIZE       4     // Coalesced reads per recvmmsg
+#endif
+
+#define NS_UDP_GRO_BUFFER_SIZE      65536 // Fits any coalesced read
+#define NS_UDP_MAX_SEGMENTS         64    // Kernel limit for one GSO send
+#define NS_UDP_GSO_MAX_BYTES        65507 // Largest UDP payload over IPv4
+
+#ifndef NS_UDP_MAX_SESSIONS
+#define NS_UDP_MAX_SESSIONS         65536 // Peers tracked per UDP listener
+#endif
+
+#ifndef NS_CONN_SLAB_SIZE
+#define NS_CONN_SLAB_SIZE           64    // Connections per slab
+#endif
+
+#ifndef NS_DNS_TIMEOUT
+#define NS_DNS_TIMEOUT              2     // Seconds to wait for a DNS reply
+#endif
+
+#ifndef NS_DNS_MAX_ATTEMPTS
+#define NS_DNS_MAX_ATTEMPTS         3     // Queries sent before giving up
+#endif
+
+#ifndef NS_DNS_CACHE_SIZE
+#define NS_DNS_CACHE_SIZE           256   // Names cached per manager
+#endif
+
+#ifndef NS_DNS_MAX_TTL
+#define NS_DNS_MAX_TTL              3600  // Cap on the TTL of cached answers
+#endif
+
+#ifndef NS_DNS_NEGATIVE_TTL
+#define NS_DNS_NEGATIVE_TTL         30    // Seconds to remember missing names
+#endif
+
+#ifndef NS_DNS_STALE_TTL
+#define NS_DNS_STALE_TTL            60    // Serve expired answers while
+#endif                                    // refreshing, up to that long
+
+#define NS_DNS_MAX_SERVERS          3     // Like MAXNS in resolv.h
+
+#ifndef NS_HOSTS_FILE
+#ifdef _WIN32
+#define NS_HOSTS_FILE "C:\\Windows\\System32\\drivers\\etc\\hosts"
+#else
+#define NS_HOSTS_FILE "/etc/hosts"
+#endif
+#endif
+
+#ifndef NS_RESOLV_CONF
+#define NS_RESOLV_CONF "/etc/resolv.conf"
+#endif
+
+static void ns_buf_pool_init(struct ns_buf_pool *pool) {
+  size_t size = 4096;
+  int i;
+
+  memset(pool, 0, sizeof(*pool));
+  for (i = 0; i < NS_BUF_POOL_CLASSES; i++) {
+    pool->classes[i].size = size;
+    size *= i < NS_BUF_POOL_CLASSES - 2 ? 4 : 16;
+  }
+}
+
+// Return index of the smallest class that fits size, or -1 if none does
+static int ns_buf_pool_class(const struct ns_buf_pool *pool, size_t size) {
+  int i;
+  for (i = 0; i < NS_BUF_POOL_CLASSES; i++) {
+    if (size <= pool->classes[i].size) return i;
+  }
+  return -1;
+}
+
+// Allocate a buffer of at least size bytes, store its real size in *cap
+static char *ns_buf_pool_get(struct ns_buf_pool *pool, size_t size,
+                             size_t *cap) {
+  int i = ns_buf_pool_class(pool, size);
+  char *buf;
+
+  if (i < 0) {
+    if ((buf = (char *) NS_MALLOC(size)) != NULL) {
+      pool->num_large++;
+      *cap = size;
+    }
+    return buf;
+  }
+
+  pool->classes[i].num_gets++;
+  if ((buf = (char *) pool->classes[i].free_list) != NULL) {
+    memcpy(&pool->classes[i].free_list, buf, sizeof(void *));
+    pool->classes[i].num_free--;
+    pool->classes[i].num_hits++;
+  } else if ((buf = (char *) NS_MALLOC(pool->classes[i].size)) == NULL) {
+    return NULL;
+  }
+  pool->classes[i].num_used++;
+  *cap = pool->classes[i].size;
+
+  return buf;
+}
+
+static void ns_buf_pool_put(struct ns_buf_pool *pool, char *buf,
+                            size_t cap) {
+  int i = ns_buf_pool_class(pool, cap);
+
+  if (i < 0) {
+    pool->num_large--;
+    NS_FREE(buf);
+    return;
+  }
+
+  pool->classes[i].num_used--;
+  if ((pool->classes[i].num_free + 1) * pool->classes[i].size >
+      NS_BUF_POOL_MAX_FREE_BYTES) {
+    NS_FREE(buf);
+  } else {
+    memcpy(buf, &pool->classes[i].free_list, sizeof(void *));
+    pool->classes[i].free_list = buf;
+    pool->classes[i].num_free++;
+  }
+}
+
+static void ns_buf_pool_free(struct ns_buf_pool *pool) {
+  void *buf;
+  int i;
+
+  for (i = 0; i < NS_BUF_POOL_CLASSES; i++) {
+    while ((buf = pool->classes[i].free_list) != NULL) {
+      memcpy(&pool->classes[i].free_list, buf, sizeof(void *));
+      NS_FREE(buf);
+    }
+    pool->classes[i].num_free = 0;
+  }
+}
+
+// Move pooled iobuf to a buffer of the class that fits new_size
+static void iobuf_pool_resize(struct iobuf *io, size_t new_size) {
+  int i = ns_buf_pool_class(io->pool, new_size);
+  size_t cap = i < 0 ? new_size : io->pool->classes[i].size;
+  char *p;
+
+  if (new_size < io->len || cap == io->size) {
+  } else if (new_size == 0) {
+    ns_buf_pool_put(io->pool, io->buf, io->size);
+    io->buf = NULL;
+    io->size = 0;
+  } else if ((p = ns_buf_pool_get(io->pool, new_size, &cap)) != NULL) {
+    if (io->len > 0) memcpy(p, io->buf, io->len);
+    if (io->buf != NULL) ns_buf_pool_put(io->pool, io->buf, io->size);
+    io->buf = p;
+    io->size = cap;
+  }
+}
 
 void iobuf_resize(struct iobuf *io, size_t new_size) {
   char *p;
-  if ((new_size > io->size || (new_size < io->size && new_size >= io->len)) &&
-      (p = (char *) NS_REALLOC(io->buf, new_size)) != NULL) {
+  if (io->pool != NULL) {
+    iobuf_pool_resize(io, new_size);
+  } else if ((new_size > io->size ||
+              (new_size < io->size && new_size >= io->len)) &&
+             (p = (char *) NS_REALLOC(io->buf, new_size)) != NULL) {
     io->size = new_size;
     io->buf = p;
   }
@@ -50,13 +221,27 @@ void iobuf_resize(struct iobuf *io, size_t new_size) {
 void iobuf_init(struct iobuf *iobuf, size_t initial_size) {
   iobuf->len = iobuf->size = 0;
   iobuf->buf = NULL;
+  iobuf->pool = NULL;
   iobuf_resize(iobuf, initial_size);
 }
 
 void iobuf_free(struct iobuf *iobuf) {
   if (iobuf != NULL) {
-    if (iobuf->buf != NULL) NS_FREE(iobuf->buf);
-    iobuf_init(iobuf, 0);
+    if (iobuf->buf != NULL && iobuf->pool != NULL) {
+      ns_buf_pool_put(iobuf->pool, iobuf->buf, iobuf->size);
+    } else if (iobuf->buf != NULL) {
+      NS_FREE(iobuf->buf);
+    }
+    iobuf->buf = NULL;
+    iobuf->len = iobuf->size = 0;
+  }
+}
+
+// Give memory of a drained pooled iobuf back to the pool, so that idle
+// connections don't hold buffers
+static void iobuf_release_if_empty(struct iobuf *io) {
+  if (io->len == 0 && io->buf != NULL && io->pool != NULL) {
+    iobuf_free(io);
   }
 }
 
@@ -70,6 +255,14 @@ size_t iobuf_append(struct iobuf *io, const void *buf, size_t len) {
   } else if (io->len + len <= io->size) {
     memcpy(io->buf + io->len, buf, len);
     io->len += len;
+  } else if (io->pool != NULL) {
+    iobuf_resize(io, io->len + len);
+    if (io->len + len <= io->size) {
+      memcpy(io->buf + io->len, buf, len);
+      io->len += len;
+    } else {
+      len = 0;
+    }
   } else if ((p = (char *) NS_REALLOC(io->buf, io->len + len)) != NULL) {
     io->buf = p;
     memcpy(io->buf + io->len, buf, len);
@@ -89,14 +282,43 @@ void iobuf_remove(struct iobuf *io, size_t n) {
   }
 }
 
+static void ns_check_watermarks(struct ns_connection *);
+
+static socklen_t ns_sa_len(const union socket_address *sa) {
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) return sizeof(sa->sin6);
+#endif
+  return sizeof(sa->sin);
+}
+
+// Outgoing datagrams of a UDP connection are queued in send_iobuf, each
+// prefixed by its length and destination, and flushed by
+// ns_write_to_udp_socket(). The destination is taken when the datagram is
+// queued, as nc->sa may be changed before the next poll.
 static size_t ns_out(struct ns_connection *nc, const void *buf, size_t len) {
-  if (nc->flags & NSF_UDP) {
-    long n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, sizeof(nc->sa.sin));
+  if ((nc->flags & NSF_UDP) && nc->listener != NULL) {
+    // Reply to a datagram received by a listener, see ns_handle_udp()
+    long n = sendto(nc->sock, buf, len, 0, &nc->sa.sa, ns_sa_len(&nc->sa));
     DBG(("%p %d send %ld (%d %s)", nc, nc->sock, n, errno, strerror(errno)));
     return n < 0 ? 0 : n;
-  } else {
-    return iobuf_append(&nc->send_iobuf, buf, len);
+  } else if (nc->flags & NSF_UDP) {
+    uint32_t n = (uint32_t) len;
+    if (iobuf_append(&nc->send_iobuf, &n, sizeof(n)) != sizeof(n)) return 0;
+    if (iobuf_append(&nc->send_iobuf, &nc->sa, sizeof(nc->sa)) !=
+        sizeof(nc->sa)) {
+      nc->send_iobuf.len -= sizeof(n);
+      return 0;
+    }
+    if (iobuf_append(&nc->send_iobuf, buf, len) != len) {
+      nc->send_iobuf.len -= sizeof(n) + sizeof(nc->sa);
+      return 0;
+    }
+  } else if ((len = iobuf_append(&nc->send_iobuf, buf, len)) == 0) {
+    return 0;
   }
+  ns_check_watermarks(nc);
+
+  return len;
 }
 
 #ifndef NS_DISABLE_THREADS
@@ -120,8 +342,56 @@ void *ns_start_thread(void *(*f)(void *), void *p) {
   return (void *) thread_id;
 #endif
 }
+
+#ifdef _WIN32
+#define ns_mutex_init(m)      InitializeCriticalSection(m)
+#define ns_mutex_destroy(m)   DeleteCriticalSection(m)
+#define ns_mutex_lock(m)      EnterCriticalSection(m)
+#define ns_mutex_unlock(m)    LeaveCriticalSection(m)
+#define ns_cond_init(c)       InitializeConditionVariable(c)
+#define ns_cond_destroy(c)    ((void) (c))
+#define ns_cond_wait(c, m)    SleepConditionVariableCS((c), (m), INFINITE)
+#define ns_cond_signal(c)     WakeConditionVariable(c)
+#define ns_cond_broadcast(c)  WakeAllConditionVariable(c)
+#else
+#define ns_mutex_init(m)      pthread_mutex_init((m), NULL)
+#define ns_mutex_destroy(m)   pthread_mutex_destroy(m)
+#define ns_mutex_lock(m)      pthread_mutex_lock(m)
+#define ns_mutex_unlock(m)    pthread_mutex_unlock(m)
+#define ns_cond_init(c)       pthread_cond_init((c), NULL)
+#define ns_cond_destroy(c)    pthread_cond_destroy(c)
+#define ns_cond_wait(c, m)    pthread_cond_wait((c), (m))
+#define ns_cond_signal(c)     pthread_cond_signal(c)
+#define ns_cond_broadcast(c)  pthread_cond_broadcast(c)
+#endif
+#else
+// Single threaded build: locks are no-ops
+#define ns_mutex_init(m)      ((void) (m))
+#define ns_mutex_destroy(m)   ((void) (m))
+#define ns_mutex_lock(m)      ((void) (m))
+#define ns_mutex_unlock(m)    ((void) (m))
+#define ns_cond_init(c)       ((void) (c))
+#define ns_cond_destroy(c)    ((void) (c))
+#define ns_cond_wait(c, m)    ((void) (c), (void) (m))
+#define ns_cond_signal(c)     ((void) (c))
+#define ns_cond_broadcast(c)  ((void) (c))
 #endif  // NS_DISABLE_THREADS
 
+// Atomic primitives for the lock-free ctl queue
+#ifdef _MSC_VER
+#define ns_atomic_xchg_ptr(p, v) \
+  InterlockedExchangePointer((PVOID volatile *) (p), (v))
+#define ns_atomic_xchg_int(p, v) \
+  InterlockedExchange((LONG volatile *) (p), (v))
+#define ns_atomic_load_ptr(p)     (*(p))    // volatile has acquire semantics
+#define ns_atomic_store_ptr(p, v) (*(p) = (v))
+#else
+#define ns_atomic_xchg_ptr(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define ns_atomic_xchg_int(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define ns_atomic_load_ptr(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ns_atomic_store_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
 static void ns_add_conn(struct ns_mgr *mgr, struct ns_connection *c) {
   c->next = mgr->active_connections;
   mgr->active_connections = c;
@@ -159,7 +429,7 @@ int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap) {
       len = vsnprintf(*buf, size, fmt, ap_copy);
       va_end(ap_copy);
     }
-  } else if (len > (int) size) {
+  } else if (len >= (int) size) {
     // Standard-compliant code path. Allocate a buffer that is large enough.
     if ((*buf = (char *) NS_MALLOC(len + 1)) == NULL) {
       len = -1;
@@ -230,7 +500,260 @@ static void ns_call(struct ns_connection *nc, int ev, void *p) {
   nc->callback(nc, ev, p);
 }
 
+// Report send_iobuf crossing the watermarks, and pause or resume reading
+// on the flow peer accordingly
+static void ns_check_watermarks(struct ns_connection *nc) {
+  size_t len = nc->send_iobuf.len;
+
+  if (nc->send_high_wm > 0 && !(nc->flags & NSF_SEND_BLOCKED) &&
+      len >= nc->send_high_wm) {
+    nc->flags |= NSF_SEND_BLOCKED;
+    if (nc->flow_peer != NULL) nc->flow_peer->flags |= NSF_DONT_RECV;
+    ns_call(nc, NS_SEND_BLOCKED, &len);
+  } else if ((nc->flags & NSF_SEND_BLOCKED) && len <= nc->send_low_wm) {
+    nc->flags &= ~NSF_SEND_BLOCKED;
+    if (nc->flow_peer != NULL) nc->flow_peer->flags &= ~NSF_DONT_RECV;
+    ns_call(nc, NS_SEND_DRAINED, &len);
+  }
+}
+
+// Connection objects are carved from per-manager slabs allocated with
+// NS_MALLOC, and recycled through a free list linked by the next pointer.
+// Slabs never move, so a connection keeps its slot number (ns_connection::id)
+// for its whole life, and ns_mgr_poll() can walk all connections as a linear
+// scan over the slabs. Unused slots carry NSF_UNUSED.
+// Slabs are released by ns_mgr_free().
+struct ns_conn_slab {
+  struct ns_connection conns[NS_CONN_SLAB_SIZE];
+};
+
+static struct ns_connection *ns_alloc_conn(struct ns_mgr *mgr) {
+  struct ns_connection *conn;
+  struct ns_conn_slab *slab, **slabs;
+  unsigned int id, gen;
+  int i;
+
+  if (mgr->free_conns == NULL) {
+    slabs = (struct ns_conn_slab **) NS_REALLOC(mgr->conn_slabs,
+      (mgr->num_conn_slabs + 1) * sizeof(*slabs));
+    if (slabs == NULL) {
+      return NULL;
+    }
+    mgr->conn_slabs = slabs;
+    if ((slab = (struct ns_conn_slab *) NS_MALLOC(sizeof(*slab))) == NULL) {
+      return NULL;
+    }
+    id = (unsigned int) (mgr->num_conn_slabs * NS_CONN_SLAB_SIZE);
+    slabs[mgr->num_conn_slabs++] = slab;
+    // Link backwards so that connections are handed out in address order
+    for (i = NS_CONN_SLAB_SIZE - 1; i >= 0; i--) {
+      slab->conns[i].flags = NSF_UNUSED;
+      slab->conns[i].id = id + i;
+      slab->conns[i].gen = 0;
+      slab->conns[i].next = mgr->free_conns;
+      mgr->free_conns = &slab->conns[i];
+    }
+  }
+
+  conn = mgr->free_conns;
+  mgr->free_conns = conn->next;
+  id = conn->id;
+  gen = conn->gen;
+  memset(conn, 0, sizeof(*conn));
+  conn->id = id;
+  conn->gen = gen;
+
+  return conn;
+}
+
+static void ns_free_conn(struct ns_mgr *mgr, struct ns_connection *conn) {
+  conn->flags = NSF_UNUSED;
+  conn->gen++;  // Invalidate outstanding handles
+  conn->next = mgr->free_conns;
+  mgr->free_conns = conn;
+}
+
+static void ns_free_conn_slabs(struct ns_mgr *mgr) {
+  size_t i;
+
+  for (i = 0; i < mgr->num_conn_slabs; i++) {
+    NS_FREE(mgr->conn_slabs[i]);
+  }
+  NS_FREE(mgr->conn_slabs);
+  mgr->conn_slabs = NULL;
+  mgr->free_conns = NULL;
+  mgr->num_conn_slabs = 0;
+}
+
+// Return the first connection in use at slot *id or after it, and advance
+// *id past it. Connections are visited in memory order.
+static struct ns_connection *ns_scan_conns(struct ns_mgr *mgr,
+                                           unsigned int *id) {
+  size_t n = mgr->num_conn_slabs * NS_CONN_SLAB_SIZE;
+  struct ns_connection *c;
+
+  for (; *id < n; (*id)++) {
+    c = &mgr->conn_slabs[*id / NS_CONN_SLAB_SIZE]->conns[
+      *id % NS_CONN_SLAB_SIZE];
+    if (!(c->flags & NSF_UNUSED)) {
+      (*id)++;
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+// Sessions of a UDP listener, hashed by peer address. The bucket array
+// doubles when the table holds more sessions than buckets.
+struct ns_udp_sessions {
+  struct ns_udp_session **buckets;
+  size_t num_buckets;               // Power of two
+  size_t num_sessions;
+  int idle_timeout;
+  time_t last_sweep;
+};
+
+static int ns_sa_eq(const union socket_address *a,
+                    const union socket_address *b) {
+#ifdef NS_ENABLE_IPV6
+  if (a->sa.sa_family == AF_INET6) {
+    return b->sa.sa_family == AF_INET6 &&
+      a->sin6.sin6_port == b->sin6.sin6_port &&
+      memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+             sizeof(a->sin6.sin6_addr)) == 0;
+  }
+#endif
+  return a->sa.sa_family == b->sa.sa_family &&
+    a->sin.sin_port == b->sin.sin_port &&
+    a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+static size_t ns_sa_hash(const union socket_address *sa) {
+  const unsigned char *p = (const unsigned char *) &sa->sin.sin_addr;
+  size_t i, len = sizeof(sa->sin.sin_addr);
+  unsigned int h = 2166136261U;  // FNV-1a over address and port
+
+#ifdef NS_ENABLE_IPV6
+  if (sa->sa.sa_family == AF_INET6) {
+    p = (const unsigned char *) &sa->sin6.sin6_addr;
+    len = sizeof(sa->sin6.sin6_addr);
+  }
+#endif
+  for (i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619U;
+  }
+  h = (h ^ (sa->sin.sin_port & 0xff)) * 16777619U;
+  h = (h ^ (sa->sin.sin_port >> 8)) * 16777619U;
+
+  return h;
+}
+
+int ns_set_udp_sessions(struct ns_connection *nc, int idle_timeout) {
+  struct ns_udp_sessions *t = nc->udp_sessions;
+
+  if (!(nc->flags & NSF_UDP) || !(nc->flags & NSF_LISTENING)) return -1;
+  if (t == NULL) {
+    if ((t = (struct ns_udp_sessions *) NS_MALLOC(sizeof(*t))) == NULL) {
+      return -1;
+    }
+    memset(t, 0, sizeof(*t));
+    t->num_buckets = 64;
+    t->buckets = (struct ns_udp_session **)
+      NS_MALLOC(t->num_buckets * sizeof(t->buckets[0]));
+    if (t->buckets == NULL) {
+      NS_FREE(t);
+      return -1;
+    }
+    memset(t->buckets, 0, t->num_buckets * sizeof(t->buckets[0]));
+    nc->udp_sessions = t;
+  }
+  t->idle_timeout = idle_timeout;
+  nc->flags |= NSF_UDP_DATAGRAM;
+
+  return 0;
+}
+
+static void ns_udp_grow_sessions(struct ns_udp_sessions *t) {
+  size_t i, n = t->num_buckets * 2;
+  struct ns_udp_session **b, *s, *next;
+
+  if ((b = (struct ns_udp_session **) NS_MALLOC(n * sizeof(b[0]))) == NULL) {
+    return;  // Keep using longer chains
+  }
+  memset(b, 0, n * sizeof(b[0]));
+  for (i = 0; i < t->num_buckets; i++) {
+    for (s = t->buckets[i]; s != NULL; s = next) {
+      size_t j = ns_sa_hash(&s->peer) & (n - 1);
+      next = s->next;
+      s->next = b[j];
+      b[j] = s;
+    }
+  }
+  NS_FREE(t->buckets);
+  t->buckets = b;
+  t->num_buckets = n;
+}
+
+// Find the sender's session, creating it for a new peer. NULL if the table
+// is full, or out of memory.
+static struct ns_udp_session *ns_udp_session(struct ns_udp_sessions *t,
+                                             const union socket_address *sa,
+                                             time_t now) {
+  size_t i = ns_sa_hash(sa) & (t->num_buckets - 1);
+  struct ns_udp_session **b = &t->buckets[i], *s;
+
+  for (s = *b; s != NULL; s = s->next) {
+    if (ns_sa_eq(&s->peer, sa)) break;
+  }
+  if (s == NULL && t->num_sessions < NS_UDP_MAX_SESSIONS &&
+      (s = (struct ns_udp_session *) NS_MALLOC(sizeof(*s))) != NULL) {
+    memset(s, 0, sizeof(*s));
+    s->peer = *sa;
+    s->next = *b;
+    *b = s;
+    if (++t->num_sessions > t->num_buckets) ns_udp_grow_sessions(t);
+  }
+  if (s != NULL) s->last_io_time = now;
+
+  return s;
+}
+
+// End sessions idle since before cutoff. With cutoff 0, end all of them.
+// Each one is reported with NS_UDP_SESSION_END before it is freed.
+static void ns_udp_end_sessions(struct ns_connection *nc, time_t cutoff) {
+  struct ns_udp_sessions *t = nc->udp_sessions;
+  struct ns_udp_session **p, *s;
+  size_t i;
+
+  for (i = 0; i < t->num_buckets; i++) {
+    for (p = &t->buckets[i]; (s = *p) != NULL;) {
+      if (cutoff == 0 || s->last_io_time < cutoff) {
+        *p = s->next;
+        t->num_sessions--;
+        ns_call(nc, NS_UDP_SESSION_END, s);
+        NS_FREE(s);
+      } else {
+        p = &s->next;
+      }
+    }
+  }
+}
+
+static void ns_udp_expire_sessions(struct ns_connection *nc, time_t now) {
+  struct ns_udp_sessions *t = nc->udp_sessions;
+
+  if (t->idle_timeout > 0 && t->num_sessions > 0 && now != t->last_sweep) {
+    t->last_sweep = now;
+    ns_udp_end_sessions(nc, now - t->idle_timeout);
+  }
+}
+
 static void ns_destroy_conn(struct ns_connection *conn) {
+  if (conn->udp_sessions != NULL) {
+    NS_FREE(conn->udp_sessions->buckets);
+    NS_FREE(conn->udp_sessions);
+  }
   closesocket(conn->sock);
   iobuf_free(&conn->recv_iobuf);
   iobuf_free(&conn->send_iobuf);
@@ -242,11 +765,15 @@ static void ns_destroy_conn(struct ns_connection *conn) {
     SSL_CTX_free(conn->ssl_ctx);
   }
 #endif
-  NS_FREE(conn);
+  ns_free_conn(conn->mgr, conn);
 }
 
 static void ns_close_conn(struct ns_connection *conn) {
   DBG(("%p %d", conn, conn->flags));
+  if (conn->udp_sessions != NULL) {
+    ns_udp_end_sessions(conn, 0);
+  }
+  ns_set_flow_peer(conn, NULL);
   ns_call(conn, NS_CLOSE, NULL);
   ns_remove_conn(conn);
   ns_destroy_conn(conn);
@@ -312,7 +839,8 @@ int ns_socketpair(sock_t sp[2]) {
 }
 #endif  // NS_DISABLE_SOCKETPAIR
 
-// TODO(lsm): use non-blocking resolver
+// Blocking resolver, used by ns_bind() and ns_resolve(). ns_connect() uses
+// the asynchronous one, see ns_resolve_async().
 static int ns_resolve2(const char *host, struct in_addr *ina) {
   struct hostent *he;
   if ((he = gethostbyname(host)) == NULL) {
@@ -331,9 +859,66 @@ int ns_resolve(const char *host, char *buf, size_t n) {
   return ns_resolve2(host, &ad) ? snprintf(buf, n, "%s", inet_ntoa(ad)) : 0;
 }
 
+#if defined(_WIN32) && !defined(NS_ENABLE_SSL)
+#include <ntsecapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "advapi32.lib")  // RtlGenRandom()
+#endif
+#endif
+
+// Fill the buffer with cryptographically strong random bytes. Return 0 on
+// success, -1 if no strong random source is available.
+static int ns_fill_random(unsigned char *buf, size_t len) {
+#if defined(NS_ENABLE_SSL)
+  return RAND_bytes(buf, (int) len) == 1 ? 0 : -1;
+#elif defined(_WIN32)
+  return RtlGenRandom(buf, (ULONG) len) ? 0 : -1;
+#else
+  FILE *fp;
+  size_t n = 0;
+  if ((fp = fopen("/dev/urandom", "rb")) != NULL) {
+    n = fread(buf, 1, len, fp);
+    fclose(fp);
+  }
+  return n == len ? 0 : -1;
+#endif
+}
+
+// Get random bytes, e.g. for websocket masks and DNS query IDs. Random data
+// is read from the OS (or SSL library) in batches, so that small requests
+// do not cost a system call each. Must be called from the thread that
+// runs the manager. Return 0 on success, or -1 if no strong random source
+// is available; there is no weak fallback, callers must fail instead.
+int ns_random(struct ns_mgr *mgr, void *buf, size_t len) {
+  unsigned char *dst = (unsigned char *) buf;
+  size_t n;
+
+  while (len > 0) {
+    if (mgr->rnd_pos >= sizeof(mgr->rnd_pool)) {
+      if (ns_fill_random(mgr->rnd_pool, sizeof(mgr->rnd_pool)) != 0) {
+        return -1;
+      }
+      mgr->rnd_pos = 0;
+    }
+    n = sizeof(mgr->rnd_pool) - mgr->rnd_pos;
+    if (n > len) n = len;
+    memcpy(dst, mgr->rnd_pool + mgr->rnd_pos, n);
+    // Do not keep handed out bytes around
+    memset(mgr->rnd_pool + mgr->rnd_pos, 0, n);
+    mgr->rnd_pos += n;
+    dst += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
 // Address format: [PROTO://][IP_ADDRESS:]PORT[:CERT][:CA_CERT]
+// If "name" is not NULL, host names are not resolved but copied to it
+// (at least 200 bytes), and sa is left with INADDR_ANY.
 static int ns_parse_address(const char *str, union socket_address *sa,
-                            int *proto, int *use_ssl, char *cert, char *ca) {
+                            int *proto, int *use_ssl, char *cert, char *ca,
+                            char *name) {
   unsigned int a, b, c, d, port;
   int n = 0, len = 0;
   char host[200];
@@ -350,6 +935,7 @@ static int ns_parse_address(const char *str, union socket_address *sa,
   *proto = SOCK_STREAM;
   *use_ssl = 0;
   cert[0] = ca[0] = '\0';
+  if (name != NULL) name[0] = '\0';
 
   if (memcmp(str, "ssl://", 6) == 0) {
     str += 6;
@@ -374,7 +960,11 @@ static int ns_parse_address(const char *str, union socket_address *sa,
 #endif
   } else if (sscanf(str, "%199[^ :]:%u%n", host, &port, &len) == 2) {
     sa->sin.sin_port = htons((uint16_t) port);
-    ns_resolve2(host, &sa->sin.sin_addr);
+    if (name != NULL) {
+      strcpy(name, host);
+    } else {
+      ns_resolve2(host, &sa->sin.sin_addr);
+    }
   } else if (sscanf(str, "%u%n", &port, &len) == 1) {
     // If only port is specified, bind to IPv4, INADDR_ANY
     sa->sin.sin_port = htons((uint16_t) port);
@@ -448,71 +1038,398 @@ static int ns_use_cert(SSL_CTX *ctx, const char *pem_file) {
     return 0;
   }
 }
-#endif  // NS_ENABLE_SSL
 
-struct ns_connection *ns_bind(struct ns_mgr *srv, const char *str,
-                              ns_callback_t callback, void *user_data) {
-  union socket_address sa;
-  struct ns_connection *nc = NULL;
-  int use_ssl, proto;
-  char cert[100], ca_cert[100];
-  sock_t sock;
+// With NS_ENABLE_KTLS, ask OpenSSL to hand symmetric crypto to the kernel
+// after the handshake. If kernel or OpenSSL lack kTLS support, this is a
+// no-op and connections use user-space encryption as usual.
+static void ns_enable_ktls(SSL_CTX *ctx) {
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+  (void) ctx;
+#endif
+}
 
-  ns_parse_address(str, &sa, &proto, &use_ssl, cert, ca_cert);
-  if (use_ssl && cert[0] == '\0') return NULL;
+// Let OpenSSL free record buffers of idle connections. They are
+// reallocated when there is something to read or write.
+static void ns_release_ssl_buffers(SSL_CTX *ctx) {
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+}
 
-  if ((sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
-  } else if ((nc = ns_add_sock(srv, sock, callback, NULL)) == NULL) {
-    closesocket(sock);
-  } else {
-    nc->sa = sa;
-    nc->flags |= NSF_LISTENING;
-    nc->user_data = user_data;
-    nc->callback = callback;
+#ifndef NS_SSL_TICKET_KEY_LIFETIME
+#define NS_SSL_TICKET_KEY_LIFETIME 3600   // Seconds, see ns_rotate_ticket_keys
+#endif
 
-    if (proto == SOCK_DGRAM) {
-      nc->flags |= NSF_UDP;
-    }
+#ifndef NS_MAX_CLIENT_SSL_SESSIONS
+#define NS_MAX_CLIENT_SSL_SESSIONS 32     // Per client context
+#endif
 
-#ifdef NS_ENABLE_SSL
-    if (use_ssl) {
-      nc->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
-      if (ns_use_cert(nc->ssl_ctx, cert) != 0 ||
-          ns_use_ca_cert(nc->ssl_ctx, ca_cert) != 0) {
-        ns_close_conn(nc);
-        nc = NULL;
-      }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+struct ns_ticket_key {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+};
+
+// Session ticket keys of a listening SSL_CTX. New tickets are issued with
+// the current key, tickets of the previous key are still accepted but get
+// renewed. Stored in the context's ex_data. Locked, because handshakes may
+// run on SSL worker threads.
+struct ns_ticket_keys {
+  ns_mutex_t lock;
+  time_t rotated;                 // When current key was generated
+  struct ns_ticket_key keys[2];   // Current and previous key
+};
+
+static int s_ticket_keys_idx = -1;
+
+static void ns_free_ticket_keys(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                                int idx, long argl, void *argp) {
+  (void) parent; (void) ad; (void) idx; (void) argl; (void) argp;
+  if (ptr != NULL) {
+    ns_mutex_destroy(&((struct ns_ticket_keys *) ptr)->lock);
+    OPENSSL_cleanse(ptr, sizeof(struct ns_ticket_keys));
+    NS_FREE(ptr);
+  }
+}
+
+static int ns_rotate_ticket_keys(struct ns_ticket_keys *k, time_t now) {
+  if (now - k->rotated < NS_SSL_TICKET_KEY_LIFETIME) return 0;
+  memcpy(&k->keys[1], &k->keys[0], sizeof(k->keys[1]));
+  if (RAND_bytes((unsigned char *) &k->keys[0], sizeof(k->keys[0])) != 1) {
+    return -1;
+  }
+  k->rotated = now;
+  return 0;
+}
+
+static int ns_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                            EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx,
+                            int enc) {
+  struct ns_ticket_keys *k = (struct ns_ticket_keys *)
+    SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), s_ticket_keys_idx);
+  const EVP_CIPHER *cipher = EVP_aes_256_cbc();
+  struct ns_ticket_key keys[2];
+  OSSL_PARAM params[3];
+  int i = 0, res = 1;
+
+  if (k == NULL) return -1;
+  ns_mutex_lock(&k->lock);
+  if (ns_rotate_ticket_keys(k, time(NULL)) != 0) res = -1;
+  memcpy(keys, k->keys, sizeof(keys));
+  ns_mutex_unlock(&k->lock);
+
+  if (res < 0) {
+  } else if (enc) {
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) != 1 ||
+        EVP_EncryptInit_ex(cipher_ctx, cipher, NULL, keys[0].aes_key,
+                           iv) != 1) {
+      res = -1;
     }
-#endif
+    memcpy(name, keys[0].name, sizeof(keys[0].name));
+  } else {
+    while (i < 2 && memcmp(name, keys[i].name, sizeof(keys[i].name)) != 0) {
+      i++;
+    }
+    if (i == 2) {
+      res = 0;  // Unknown or expired key, do full handshake
+    } else if (EVP_DecryptInit_ex(cipher_ctx, cipher, NULL,
+                                  keys[i].aes_key, iv) != 1) {
+      res = -1;
+    } else {
+      res = i == 0 ? 1 : 2;  // 2 tells OpenSSL to issue a fresh ticket
+    }
+  }
 
-    DBG(("%p sock %d/%d ssl %p %p", nc, sock, proto, nc->ssl_ctx, nc->ssl));
+  if (res > 0) {
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  keys[i].hmac_key,
+                                                  sizeof(keys[i].hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 (char *) "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) res = -1;
   }
+  OPENSSL_cleanse(keys, sizeof(keys));
 
-  return nc;
+  return res;
 }
+#endif
+
+// Enable server side session resumption: session ID cache, plus session
+// tickets with keys rotated every NS_SSL_TICKET_KEY_LIFETIME seconds.
+// With OpenSSL older than 3.0, tickets use OpenSSL's built-in static key.
+static int ns_enable_server_ssl_sessions(SSL_CTX *ctx) {
+  static const unsigned char sid_ctx[] = "net_skeleton";
+
+  if (ctx == NULL) return -1;
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  {
+    struct ns_ticket_keys *k;
+
+    if (s_ticket_keys_idx < 0) {
+      s_ticket_keys_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                   ns_free_ticket_keys);
+    }
+    if (s_ticket_keys_idx < 0 ||
+        (k = (struct ns_ticket_keys *) NS_MALLOC(sizeof(*k))) == NULL) {
+      return -1;
+    }
+    ns_mutex_init(&k->lock);
+    k->rotated = time(NULL);
+    if (RAND_bytes((unsigned char *) k->keys, sizeof(k->keys)) != 1 ||
+        SSL_CTX_set_ex_data(ctx, s_ticket_keys_idx, k) != 1) {
+      ns_free_ticket_keys(NULL, k, NULL, 0, 0, NULL);
+      return -1;
+    }
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ns_ticket_key_cb);
+  }
+#endif
+
+  return 0;
+}
+
+// Session of the last connection to the given peer, reused on reconnect
+struct ns_client_ssl_session {
+  struct ns_client_ssl_session *next;
+  union socket_address sa;
+  SSL_SESSION *session;
+};
+
+// Client context shared by all outbound connections that use the same
+// certificate and CA files
+struct ns_client_ssl_ctx {
+  struct ns_client_ssl_ctx *next;
+  struct ns_client_ssl_session *sessions;  // Most recently used first
+  SSL_CTX *ctx;
+  char cert[100];
+  char ca_cert[100];
+};
+
+static void ns_free_client_ssl_sessions(struct ns_client_ssl_session *s) {
+  struct ns_client_ssl_session *tmp;
+
+  for (; s != NULL; s = tmp) {
+    tmp = s->next;
+    SSL_SESSION_free(s->session);
+    NS_FREE(s);
+  }
+}
+
+static struct ns_client_ssl_ctx *ns_find_client_ssl_ctx(
+    struct ns_connection *nc) {
+  struct ns_client_ssl_ctx *cc;
+
+  for (cc = nc->mgr->client_ssl_ctxs; cc != NULL; cc = cc->next) {
+    if (cc->ctx == SSL_get_SSL_CTX(nc->ssl)) break;
+  }
+  return cc;
+}
+
+// Called by OpenSSL when the server hands out a session or a ticket.
+// Store a copy for the peer, dropping least recently used peers over the
+// limit. A copy is needed because OpenSSL marks the connection's own
+// session as not resumable when the connection is closed without
+// SSL_shutdown(), which is how connections are normally closed here.
+static int ns_new_client_ssl_session_cb(SSL *ssl, SSL_SESSION *session) {
+  struct ns_connection *nc = (struct ns_connection *) SSL_get_app_data(ssl);
+  struct ns_client_ssl_ctx *cc;
+  struct ns_client_ssl_session *s, **prev;
+  int n = 0;
+
+  if (nc == NULL || (cc = ns_find_client_ssl_ctx(nc)) == NULL ||
+      (session = SSL_SESSION_dup(session)) == NULL) {
+    return 0;
+  }
+
+  for (prev = &cc->sessions; (s = *prev) != NULL; prev = &s->next, n++) {
+    if (memcmp(&s->sa, &nc->sa, sizeof(s->sa)) == 0) break;
+  }
+  if (s != NULL) {
+    *prev = s->next;
+    SSL_SESSION_free(s->session);
+  } else if ((s = (struct ns_client_ssl_session *)
+              NS_MALLOC(sizeof(*s))) == NULL) {
+    SSL_SESSION_free(session);
+    return 0;
+  } else if (n >= NS_MAX_CLIENT_SSL_SESSIONS) {
+    for (prev = &cc->sessions; n-- > 1; prev = &(*prev)->next) ;
+    ns_free_client_ssl_sessions(*prev);
+    *prev = NULL;
+  }
+
+  s->sa = nc->sa;
+  s->session = session;
+  s->next = cc->sessions;
+  cc->sessions = s;
+
+  return 0;
+}
+
+// Try to resume the last session with the same peer. Sessions are keyed
+// by address, so this must run after the host name is resolved.
+static void ns_resume_client_ssl_session(struct ns_connection *nc) {
+  struct ns_client_ssl_ctx *cc = ns_find_client_ssl_ctx(nc);
+  struct ns_client_ssl_session *s;
+  SSL_SESSION *copy;
+
+  for (s = cc == NULL ? NULL : cc->sessions; s != NULL; s = s->next) {
+    if (memcmp(&s->sa, &nc->sa, sizeof(s->sa)) == 0) {
+      // Hand out a copy, the connection's own session is marked as not
+      // resumable when it is closed, see ns_new_client_ssl_session_cb()
+      if (SSL_SESSION_is_resumable(s->session) &&
+          (copy = SSL_SESSION_dup(s->session)) != NULL) {
+        SSL_set_session(nc->ssl, copy);
+        SSL_SESSION_free(copy);
+      }
+      break;
+    }
+  }
+}
+
+// Return client context for the given cert/CA pair. SSL_CTX is created and
+// cached on first use, so files are loaded only once per manager. The cache
+// holds one reference, and every SSL created by SSL_new() holds another.
+static struct ns_client_ssl_ctx *ns_get_client_ssl_ctx(struct ns_mgr *mgr,
+                                                       const char *cert,
+                                                       const char *ca_cert) {
+  struct ns_client_ssl_ctx *p;
+  SSL_CTX *ctx;
+
+  for (p = mgr->client_ssl_ctxs; p != NULL; p = p->next) {
+    if (strcmp(p->cert, cert) == 0 && strcmp(p->ca_cert, ca_cert) == 0) {
+      return p;
+    }
+  }
+
+  if ((ctx = SSL_CTX_new(SSLv23_client_method())) == NULL) {
+    return NULL;
+  } else if (ns_use_cert(ctx, cert) != 0 ||
+             ns_use_ca_cert(ctx, ca_cert) != 0 ||
+             (p = (struct ns_client_ssl_ctx *) NS_MALLOC(sizeof(*p))) == NULL) {
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+
+  ns_enable_ktls(ctx);
+  ns_release_ssl_buffers(ctx);
+
+  // Sessions are stored per peer by ns_new_client_ssl_session_cb()
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                 SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, ns_new_client_ssl_session_cb);
+
+  p->ctx = ctx;
+  p->sessions = NULL;
+  snprintf(p->cert, sizeof(p->cert), "%s", cert);
+  snprintf(p->ca_cert, sizeof(p->ca_cert), "%s", ca_cert);
+  p->next = mgr->client_ssl_ctxs;
+  mgr->client_ssl_ctxs = p;
+
+  return p;
+}
+
+static void ns_free_client_ssl_ctxs(struct ns_mgr *mgr) {
+  struct ns_client_ssl_ctx *p, *tmp;
+
+  for (p = mgr->client_ssl_ctxs; p != NULL; p = tmp) {
+    tmp = p->next;
+    ns_free_client_ssl_sessions(p->sessions);
+    SSL_CTX_free(p->ctx);
+    NS_FREE(p);
+  }
+  mgr->client_ssl_ctxs = NULL;
+}
+#endif  // NS_ENABLE_SSL
+
+struct ns_connection *ns_bind(struct ns_mgr *srv, const char *str,
+                              ns_callback_t callback, void *user_data) {
+  union socket_address sa;
+  struct ns_connection *nc = NULL;
+  int use_ssl, proto;
+  char cert[100], ca_cert[100];
+  sock_t sock;
+
+  ns_parse_address(str, &sa, &proto, &use_ssl, cert, ca_cert, NULL);
+  if (use_ssl && cert[0] == '\0') return NULL;
+
+  if ((sock = ns_open_listening_socket(&sa, proto)) == INVALID_SOCKET) {
+  } else if ((nc = ns_add_sock(srv, sock, callback, NULL)) == NULL) {
+    closesocket(sock);
+  } else {
+    nc->sa = sa;
+    nc->flags |= NSF_LISTENING;
+    nc->user_data = user_data;
+    nc->callback = callback;
+
+    if (proto == SOCK_DGRAM) {
+      nc->flags |= NSF_UDP;
+    }
+
+#ifdef NS_ENABLE_SSL
+    if (use_ssl) {
+      nc->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+      if (ns_use_cert(nc->ssl_ctx, cert) != 0 ||
+          ns_use_ca_cert(nc->ssl_ctx, ca_cert) != 0 ||
+          ns_enable_server_ssl_sessions(nc->ssl_ctx) != 0) {
+        ns_close_conn(nc);
+        nc = NULL;
+      } else {
+        ns_enable_ktls(nc->ssl_ctx);
+        ns_release_ssl_buffers(nc->ssl_ctx);
+      }
+    }
+#endif
+
+    DBG(("%p sock %d/%d ssl %p %p", nc, sock, proto, nc->ssl_ctx, nc->ssl));
+  }
+
+  return nc;
+}
+
+static struct ns_connection *ns_add_sock2(struct ns_mgr *, sock_t,
+                                          ns_callback_t, void *, int);
 
 static struct ns_connection *accept_conn(struct ns_connection *ls) {
   struct ns_connection *c = NULL;
   union socket_address sa;
   socklen_t len = sizeof(sa);
   sock_t sock = INVALID_SOCKET;
+  int set_flags = 1;
 
   // NOTE(lsm): on Windows, sock is always > FD_SETSIZE
-  if ((sock = accept(ls->sock, &sa.sa, &len)) == INVALID_SOCKET) {
-  } else if ((c = ns_add_sock(ls->mgr, sock, ls->callback,
-              ls->user_data)) == NULL) {
+#ifdef NS_ENABLE_ACCEPT4
+  // Socket comes out non-blocking and close-on-exec, no fcntl() needed
+  sock = accept4(ls->sock, &sa.sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  set_flags = 0;
+#else
+  sock = accept(ls->sock, &sa.sa, &len);
+#endif
+  if (sock == INVALID_SOCKET) {
+  } else if ((c = ns_add_sock2(ls->mgr, sock, ls->callback, ls->user_data,
+                               set_flags)) == NULL) {
     closesocket(sock);
 #ifdef NS_ENABLE_SSL
-  } else if (ls->ssl_ctx != NULL &&
-             ((c->ssl = SSL_new(ls->ssl_ctx)) == NULL ||
-              SSL_set_fd(c->ssl, sock) != 1)) {
-    DBG(("SSL error"));
-    ns_close_conn(c);
+  } else if (ls->ssl_ctx != NULL && SSL_CTX_up_ref(ls->ssl_ctx) != 1) {
+    // Never fall back to plaintext on a TLS listener. The handler has not
+    // seen the connection yet, so no NS_CLOSE either.
+    ns_remove_conn(c);
+    ns_destroy_conn(c);
     c = NULL;
 #endif
   } else {
+#ifdef NS_ENABLE_SSL
+    // SSL object is created by ns_ssl_init_accepted() when the client
+    // actually talks, so idle connections don't hold SSL state
+    c->ssl_ctx = ls->ssl_ctx;
+#endif
     c->listener = ls;
     c->proto_data = ls->proto_data;
+    c->send_high_wm = ls->send_high_wm;
+    c->send_low_wm = ls->send_low_wm;
     ns_call(c, NS_ACCEPT, &sa);
     DBG(("%p %d %p %p", c, c->sock, c->ssl_ctx, c->ssl));
   }
@@ -520,6 +1437,21 @@ static struct ns_connection *accept_conn(struct ns_connection *ls) {
   return c;
 }
 
+// Accept pending connections, at most ns_mgr::accept_budget of them, so
+// that a reconnect storm does not take one poll per client
+static void ns_accept_conns(struct ns_connection *ls) {
+#ifdef NS_ACCEPT_ONE_PER_POLL
+  accept_conn(ls);
+#else
+  int i;
+
+  for (i = 0; i < ls->mgr->accept_budget &&
+       !(ls->flags & NSF_CLOSE_IMMEDIATELY); i++) {
+    if (accept_conn(ls) == NULL) break;
+  }
+#endif
+}
+
 static int ns_is_error(int n) {
   return n == 0 ||
     (n < 0 && errno != EINTR && errno != EINPROGRESS &&
@@ -584,18 +1516,229 @@ int ns_hexdump(const void *buf, int len, char *dst, int dst_len) {
 }
 
 #ifdef NS_ENABLE_SSL
-static int ns_ssl_err(struct ns_connection *conn, int res) {
-  int ssl_err = SSL_get_error(conn->ssl, res);
+static void ns_ssl_set_want_flags(struct ns_connection *conn, int ssl_err) {
   if (ssl_err == SSL_ERROR_WANT_READ) conn->flags |= NSF_WANT_READ;
   if (ssl_err == SSL_ERROR_WANT_WRITE) conn->flags |= NSF_WANT_WRITE;
+}
+
+static int ns_ssl_err(struct ns_connection *conn, int res) {
+  int ssl_err = SSL_get_error(conn->ssl, res);
+  ns_ssl_set_want_flags(conn, ssl_err);
   return ssl_err;
 }
+
+static void ns_ssl_handshake_done(struct ns_connection *conn) {
+  conn->flags |= NSF_SSL_HANDSHAKE_DONE;
+#if defined(NS_ENABLE_KTLS) && defined(SSL_OP_ENABLE_KTLS)
+  // If OpenSSL has installed the session keys into the kernel, records are
+  // encrypted by the kernel and the connection can be written with plain
+  // send(), or sendfile() by the user. Reading still goes through SSL_read()
+  // which handles non-data records, e.g. alerts and session tickets.
+  if (BIO_get_ktls_send(SSL_get_wbio(conn->ssl))) {
+    conn->flags |= NSF_KTLS_SEND;
+  }
+#endif
+  DBG(("%p %s", conn, conn->flags & NSF_KTLS_SEND ? "ktls" : "tls"));
+}
+
+// Create SSL object for an accepted connection on its first IO.
+// Return -1 on error.
+static int ns_ssl_init_accepted(struct ns_connection *conn) {
+  if (conn->ssl != NULL || conn->ssl_ctx == NULL ||
+      (conn->flags & NSF_LISTENING)) {
+    return 0;
+  } else if ((conn->ssl = SSL_new(conn->ssl_ctx)) == NULL ||
+             SSL_set_fd(conn->ssl, conn->sock) != 1) {
+    DBG(("%p SSL error", conn));
+    return -1;
+  }
+  return 0;
+}
+
+// Handle result of a server side handshake step, SSL_accept()
+static void ns_ssl_accept_result(struct ns_connection *conn, int res,
+                                 int ssl_err) {
+  ns_ssl_set_want_flags(conn, ssl_err);
+  if (res == 1) {
+    ns_ssl_handshake_done(conn);
+  } else if (ssl_err != SSL_ERROR_WANT_READ &&
+             ssl_err != SSL_ERROR_WANT_WRITE) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  }
+}
+
+// Server side handshakes can be run by a pool of worker threads, so that
+// expensive private key operations do not stall the event loop. While a
+// handshake step runs on a worker, the connection has NSF_SSL_OFFLOADED set
+// and the event loop neither polls nor closes it. Workers touch nothing but
+// the SSL object; the result is applied by the event loop.
+struct ns_ssl_job {
+  struct ns_ssl_job *next;
+  struct ns_connection *nc;
+  int res;                          // SSL_accept() return value
+  int ssl_err;                      // SSL_get_error() for it
+};
+
+struct ns_ssl_workers {
+  ns_mutex_t lock;
+  ns_cond_t cond;                   // New job, shutdown or worker exit
+  struct ns_ssl_job *pending;       // Jobs waiting for a worker, FIFO
+  struct ns_ssl_job **pending_tail;
+  struct ns_ssl_job *done;          // Finished jobs for the event loop
+  sock_t wakeup[2];                 // Wakes up ns_mgr_poll() when job is done
+  int wakeup_sent;                  // Wakeup datagram is not consumed yet
+  int num_threads;                  // Running worker threads
+  int stopping;
+};
+
+#ifndef NS_DISABLE_THREADS
+static void *ns_ssl_worker(void *param) {
+  struct ns_ssl_workers *w = (struct ns_ssl_workers *) param;
+  struct ns_ssl_job *job;
+
+  ns_mutex_lock(&w->lock);
+  // On shutdown, finish pending jobs so that every connection gets its
+  // NSF_SSL_OFFLOADED flag cleared
+  while (!w->stopping || w->pending != NULL) {
+    if ((job = w->pending) == NULL) {
+      ns_cond_wait(&w->cond, &w->lock);
+      continue;
+    }
+    if ((w->pending = job->next) == NULL) w->pending_tail = &w->pending;
+    ns_mutex_unlock(&w->lock);
+
+    ERR_clear_error();
+    job->res = SSL_accept(job->nc->ssl);
+    job->ssl_err = SSL_get_error(job->nc->ssl, job->res);
+
+    ns_mutex_lock(&w->lock);
+    job->next = w->done;
+    w->done = job;
+    if (!w->wakeup_sent) {
+      w->wakeup_sent = 1;
+      send(w->wakeup[0], "", 1, 0);
+    }
+  }
+  w->num_threads--;
+  ns_cond_broadcast(&w->cond);
+  ns_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+#endif
+
+int ns_mgr_start_ssl_workers(struct ns_mgr *mgr, int num_threads) {
+#ifdef NS_DISABLE_THREADS
+  (void) mgr;
+  (void) num_threads;
+  return -1;
+#else
+  struct ns_ssl_workers *w;
+  int i;
+
+  if (mgr->ssl_workers != NULL || num_threads <= 0 ||
+      (w = (struct ns_ssl_workers *) NS_MALLOC(sizeof(*w))) == NULL) {
+    return -1;
+  }
+  memset(w, 0, sizeof(*w));
+  w->pending_tail = &w->pending;
+  if (!ns_socketpair2(w->wakeup, SOCK_DGRAM)) {
+    NS_FREE(w);
+    return -1;
+  }
+  ns_set_non_blocking_mode(w->wakeup[1]);
+  ns_mutex_init(&w->lock);
+  ns_cond_init(&w->cond);
+  mgr->ssl_workers = w;
+
+  ns_mutex_lock(&w->lock);
+  for (i = 0; i < num_threads; i++) {
+    if (ns_start_thread(ns_ssl_worker, w) != NULL) w->num_threads++;
+  }
+  ns_mutex_unlock(&w->lock);
+
+  return w->num_threads > 0 ? 0 : -1;
+#endif
+}
+
+// Hand the next handshake step to a worker. Return 0 if there are no
+// workers and the caller should do it inline.
+static int ns_ssl_offload(struct ns_connection *conn) {
+  struct ns_ssl_workers *w = conn->mgr->ssl_workers;
+  struct ns_ssl_job *job;
+
+  if (w == NULL || w->num_threads == 0 ||
+      (job = (struct ns_ssl_job *) NS_MALLOC(sizeof(*job))) == NULL) {
+    return 0;
+  }
+  job->nc = conn;
+  job->next = NULL;
+  conn->flags |= NSF_SSL_OFFLOADED;
+
+  ns_mutex_lock(&w->lock);
+  *w->pending_tail = job;
+  w->pending_tail = &job->next;
+  ns_cond_signal(&w->cond);
+  ns_mutex_unlock(&w->lock);
+
+  return 1;
+}
+
+// Apply results of finished handshake steps, called by the event loop
+static void ns_ssl_collect_jobs(struct ns_ssl_workers *w) {
+  struct ns_ssl_job *job, *tmp;
+  char buf[16];
+
+  ns_mutex_lock(&w->lock);
+  job = w->done;
+  w->done = NULL;
+  if (w->wakeup_sent) {
+    recv(w->wakeup[1], buf, sizeof(buf), 0);
+    w->wakeup_sent = 0;
+  }
+  ns_mutex_unlock(&w->lock);
+
+  for (; job != NULL; job = tmp) {
+    tmp = job->next;
+    job->nc->flags &= ~NSF_SSL_OFFLOADED;
+    ns_ssl_accept_result(job->nc, job->res, job->ssl_err);
+    NS_FREE(job);
+  }
+}
+
+static void ns_stop_ssl_workers(struct ns_mgr *mgr) {
+  struct ns_ssl_workers *w = mgr->ssl_workers;
+
+  if (w == NULL) return;
+  ns_mutex_lock(&w->lock);
+  w->stopping = 1;
+  ns_cond_broadcast(&w->cond);
+  while (w->num_threads > 0) {
+    ns_cond_wait(&w->cond, &w->lock);
+  }
+  ns_mutex_unlock(&w->lock);
+
+  ns_ssl_collect_jobs(w);
+  closesocket(w->wakeup[0]);
+  closesocket(w->wakeup[1]);
+  ns_cond_destroy(&w->cond);
+  ns_mutex_destroy(&w->lock);
+  NS_FREE(w);
+  mgr->ssl_workers = NULL;
+}
 #endif
 
 static void ns_read_from_socket(struct ns_connection *conn) {
   char buf[2048];
   int n = 0;
 
+#ifdef NS_ENABLE_SSL
+  if (ns_ssl_init_accepted(conn) != 0) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+    return;
+  }
+#endif
+
   if (conn->flags & NSF_CONNECTING) {
     int ok = 1, ret;
     socklen_t len = sizeof(ok);
@@ -607,7 +1750,7 @@ static void ns_read_from_socket(struct ns_connection *conn) {
       int res = SSL_connect(conn->ssl);
       int ssl_err = ns_ssl_err(conn, res);
       if (res == 1) {
-        conn->flags |= NSF_SSL_HANDSHAKE_DONE;
+        ns_ssl_handshake_done(conn);
       } else if (ssl_err == SSL_ERROR_WANT_READ ||
                  ssl_err == SSL_ERROR_WANT_WRITE) {
         return; // Call us again
@@ -638,15 +1781,9 @@ static void ns_read_from_socket(struct ns_connection *conn) {
       }
       ns_ssl_err(conn, n);
     } else {
-      int res = SSL_accept(conn->ssl);
-      int ssl_err = ns_ssl_err(conn, res);
-      if (res == 1) {
-        conn->flags |= NSF_SSL_HANDSHAKE_DONE;
-      } else if (ssl_err == SSL_ERROR_WANT_READ ||
-                 ssl_err == SSL_ERROR_WANT_WRITE) {
-        return; // Call us again
-      } else {
-        conn->flags |= NSF_CLOSE_IMMEDIATELY;
+      if (!ns_ssl_offload(conn)) {
+        int res = SSL_accept(conn->ssl);
+        ns_ssl_accept_result(conn, res, SSL_get_error(conn->ssl, res));
       }
       return;
     }
@@ -657,20 +1794,137 @@ static void ns_read_from_socket(struct ns_connection *conn) {
       DBG(("%p %d <- %d bytes (PLAIN)", conn, conn->flags, n));
       iobuf_append(&conn->recv_iobuf, buf, n);
       ns_call(conn, NS_RECV, &n);
+      if (conn->flags & NSF_DONT_RECV) break;  // Flow peer is full
     }
   }
 
   if (ns_is_error(n)) {
     conn->flags |= NSF_CLOSE_IMMEDIATELY;
   }
+  iobuf_release_if_empty(&conn->recv_iobuf);
+}
+
+// Send queued datagrams, NS_UDP_BATCH_SIZE per sendmmsg() call where
+// available. A datagram the kernel refuses is dropped, like a lost packet.
+static void ns_write_to_udp_socket(struct ns_connection *conn) {
+  struct iobuf *io = &conn->send_iobuf;
+  size_t off = 0, hdr_len = sizeof(uint32_t) + sizeof(union socket_address);
+  uint32_t len;
+  int n, total = 0;
+#ifdef NS_ENABLE_MMSG
+  struct mmsghdr msgs[NS_UDP_BATCH_SIZE];
+  union socket_address dst, dsts[NS_UDP_BATCH_SIZE];
+  struct iovec iov[NS_UDP_MAX_SEGMENTS];
+  size_t ends[NS_UDP_BATCH_SIZE], sizes[NS_UDP_BATCH_SIZE], pos;
+#ifdef NS_ENABLE_UDP_OFFLOAD
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } ctrl[NS_UDP_BATCH_SIZE];
+  struct cmsghdr *cmsg;
+#endif
+  struct msghdr *mh = NULL;
+  int i, num_msgs, num_iov;
+
+  while (off < io->len) {
+    memset(msgs, 0, sizeof(msgs));
+    for (num_msgs = num_iov = 0, pos = off; pos < io->len &&
+         num_iov < NS_UDP_MAX_SEGMENTS; pos += hdr_len + len) {
+      memcpy(&len, io->buf + pos, sizeof(len));
+      memcpy(&dst, io->buf + pos + sizeof(len), sizeof(dst));
+      if (num_msgs > 0 && (conn->flags & NSF_UDP_GSO) &&
+          ns_sa_eq(&dst, &dsts[num_msgs - 1]) &&
+          len <= mh->msg_iov[0].iov_len &&
+          mh->msg_iov[mh->msg_iovlen - 1].iov_len ==
+          mh->msg_iov[0].iov_len &&
+          sizes[num_msgs - 1] + len <= NS_UDP_GSO_MAX_BYTES) {
+        // Same size as the segments before it, or a shorter last one:
+        // the kernel will split it off the same send
+        mh->msg_iovlen++;
+      } else if (num_msgs < NS_UDP_BATCH_SIZE) {
+        mh = &msgs[num_msgs++].msg_hdr;
+        dsts[num_msgs - 1] = dst;
+        mh->msg_name = &dsts[num_msgs - 1];
+        mh->msg_namelen = ns_sa_len(&dst);
+        mh->msg_iov = &iov[num_iov];
+        mh->msg_iovlen = 1;
+        sizes[num_msgs - 1] = 0;
+      } else {
+        break;
+      }
+      iov[num_iov].iov_base = io->buf + pos + hdr_len;
+      iov[num_iov++].iov_len = len;
+      sizes[num_msgs - 1] += len;
+      ends[num_msgs - 1] = pos + hdr_len + len;
+    }
+
+#ifdef NS_ENABLE_UDP_OFFLOAD
+    for (i = 0; i < num_msgs; i++) {
+      if (msgs[i].msg_hdr.msg_iovlen > 1) {
+        uint16_t seg_size = (uint16_t) msgs[i].msg_hdr.msg_iov[0].iov_len;
+        msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+        cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(seg_size));
+        memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(seg_size));
+      }
+    }
+#endif
+
+    n = sendmmsg(conn->sock, msgs, num_msgs, 0);
+    DBG(("%p %d of %d messages sent", conn, n, num_msgs));
+    if (n < 0 && (errno == EIO || errno == EINVAL) &&
+        msgs[0].msg_hdr.msg_iovlen > 1) {
+      // Segmentation offload refused by the device, send one by one
+      conn->flags &= ~NSF_UDP_GSO;
+      continue;
+    }
+    if (n < 0 && !ns_is_error(n)) break;  // Socket buffer is full
+    for (i = 0; i < (n > 0 ? n : 1); i++) {
+      if (n > 0) total += (int) sizes[i];
+      off = ends[i];
+    }
+  }
+#else
+  while (off < io->len) {
+    union socket_address dst;
+    memcpy(&len, io->buf + off, sizeof(len));
+    memcpy(&dst, io->buf + off + sizeof(len), sizeof(dst));
+    n = (int) sendto(conn->sock, io->buf + off + hdr_len, len, 0,
+                     &dst.sa, ns_sa_len(&dst));
+    DBG(("%p %d send %d (%d %s)", conn, conn->sock, n, errno, strerror(errno)));
+    if (n < 0 && !ns_is_error(n)) break;
+    if (n > 0) total += n;
+    off += hdr_len + len;
+  }
+#endif
+
+  iobuf_remove(io, off);
+  iobuf_release_if_empty(io);
+  ns_call(conn, NS_SEND, &total);
+  ns_check_watermarks(conn);
 }
 
 static void ns_write_to_socket(struct ns_connection *conn) {
   struct iobuf *io = &conn->send_iobuf;
   int n = 0;
 
+  if (conn->flags & NSF_UDP) {
+    ns_write_to_udp_socket(conn);
+    return;
+  }
+
 #ifdef NS_ENABLE_SSL
-  if (conn->ssl != NULL) {
+  if (ns_ssl_init_accepted(conn) != 0) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+    return;
+  }
+#endif
+
+#ifdef NS_ENABLE_SSL
+  if (conn->ssl != NULL && !(conn->flags & NSF_KTLS_SEND)) {
     n = SSL_write(conn->ssl, io->buf, io->len);
     if (n <= 0) {
       int ssl_err = ns_ssl_err(conn, n);
@@ -684,147 +1938,1264 @@ static void ns_write_to_socket(struct ns_connection *conn) {
 #endif
   { n = (int) send(conn->sock, io->buf, io->len, 0); }
 
-  DBG(("%p %d -> %d bytes", conn, conn->flags, n));
+  DBG(("%p %d -> %d bytes", conn, conn->flags, n));
+
+  ns_call(conn, NS_SEND, &n);
+  if (ns_is_error(n)) {
+    conn->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else if (n > 0) {
+    iobuf_remove(io, n);
+    iobuf_release_if_empty(io);
+    ns_check_watermarks(conn);
+  }
+}
+
+int ns_send(struct ns_connection *conn, const void *buf, int len) {
+  return (int) ns_out(conn, buf, len);
+}
+
+// Let the kernel split queued datagrams of equal size off one send (GSO),
+// and join datagrams received by a listener into one read (GRO). Zero
+// turns an offload off. Return -1 if a requested one is not available,
+// sending and receiving then work as before.
+int ns_set_udp_offload(struct ns_connection *nc, int gso, int gro) {
+  int rc = 0;
+#ifdef NS_ENABLE_UDP_OFFLOAD
+  int zero = 0, on = gro ? 1 : 0;
+#endif
+
+  if (!(nc->flags & NSF_UDP)) return -1;
+  nc->flags &= ~(NSF_UDP_GSO | NSF_UDP_GRO);
+
+#ifdef NS_ENABLE_UDP_OFFLOAD
+  // Segment size is given with each send, this only checks for support
+  if (gso && setsockopt(nc->sock, SOL_UDP, UDP_SEGMENT, (char *) &zero,
+                        sizeof(zero)) == 0) {
+    nc->flags |= NSF_UDP_GSO;
+  } else if (gso) {
+    rc = -1;
+  }
+  if (!(nc->flags & NSF_LISTENING)) {
+    rc = gro ? -1 : rc;  // Only listeners read whole datagrams
+  } else if (setsockopt(nc->sock, SOL_UDP, UDP_GRO, (char *) &on,
+                        sizeof(on)) == 0) {
+    nc->flags |= gro ? NSF_UDP_GRO : 0;
+  } else if (gro) {
+    rc = -1;
+  }
+#else
+  rc = gso || gro ? -1 : 0;
+#endif
+
+  return rc;
+}
+
+// Make a UDP listener pass all datagrams of one read to its handler as a
+// single NS_UDP_BATCH, instead of one event per datagram
+int ns_set_udp_batch(struct ns_connection *nc, int on) {
+  if (!(nc->flags & NSF_UDP) || !(nc->flags & NSF_LISTENING)) return -1;
+  if (on) {
+    nc->flags |= NSF_UDP_BATCH;
+  } else {
+    nc->flags &= ~NSF_UDP_BATCH;
+  }
+
+  return 0;
+}
+
+// Send a datagram from a UDP socket to the given peer, right away
+int ns_send_to(struct ns_connection *conn, const union socket_address *sa,
+               const void *buf, int len) {
+  long n = sendto(conn->sock, buf, len, 0, &sa->sa, ns_sa_len(sa));
+  DBG(("%p %d send %ld (%d %s)", conn, conn->sock, n, errno, strerror(errno)));
+
+  return n < 0 ? -1 : (int) n;
+}
+
+// Make ns_send() report NS_SEND_BLOCKED once send_iobuf holds high bytes
+// or more, then NS_SEND_DRAINED when it is down to low bytes. Zero high
+// turns it off. Connections accepted by a listener inherit its settings.
+void ns_set_send_watermarks(struct ns_connection *nc, size_t high,
+                            size_t low) {
+  nc->send_high_wm = high;
+  nc->send_low_wm = low < high ? low : high;
+  if (high == 0 && (nc->flags & NSF_SEND_BLOCKED)) {
+    nc->send_low_wm = nc->send_iobuf.len;  // Unblock the peer
+  }
+  ns_check_watermarks(nc);
+}
+
+// Pair two connections that proxy data to each other: while one of them
+// is above its high watermark, the other one stops reading from its
+// socket (NSF_DONT_RECV), so a fast sender can't fill memory through a
+// slow receiver. Passing NULL as the second one breaks up the pair.
+void ns_set_flow_peer(struct ns_connection *a, struct ns_connection *b) {
+  if (a->flow_peer != NULL) {
+    a->flow_peer->flags &= ~NSF_DONT_RECV;
+    a->flow_peer->flow_peer = NULL;
+    a->flags &= ~NSF_DONT_RECV;
+    a->flow_peer = NULL;
+  }
+  if (b != NULL) {
+    ns_set_flow_peer(b, NULL);
+    a->flow_peer = b;
+    b->flow_peer = a;
+    if (a->flags & NSF_SEND_BLOCKED) b->flags |= NSF_DONT_RECV;
+    if (b->flags & NSF_SEND_BLOCKED) a->flags |= NSF_DONT_RECV;
+  }
+}
+
+// Clock that only moves forward, unaffected by changes to the wall clock.
+// Its zero point is arbitrary, so only differences are meaningful.
+uint64_t ns_monotonic_ns(void) {
+#if defined(_WIN32)
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t) (now.QuadPart / freq.QuadPart) * 1000000000 +
+    (uint64_t) (now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#else
+  return (uint64_t) time(NULL) * 1000000000;  // No monotonic clock here
+#endif
+}
+
+uint64_t ns_monotonic_ms(void) {
+  return ns_monotonic_ns() / 1000000;
+}
+
+// Read both clocks once, connections and timers use the cached values
+static void ns_update_time(struct ns_mgr *mgr) {
+  mgr->now_ms = ns_monotonic_ms();
+  mgr->now = time(NULL);
+}
+
+// Schedule NS_TIMER event to be sent to the connection when the monotonic
+// clock (ns_mgr::now_ms) reaches deadline_ms. Zero cancels the timer.
+// Return previously set deadline.
+uint64_t ns_set_timer_ms(struct ns_connection *conn, uint64_t deadline_ms) {
+  struct ns_mgr *mgr = conn->mgr;
+  uint64_t result = conn->ev_timer_ms;
+
+  conn->ev_timer_ms = deadline_ms;
+  conn->ev_timer_time = deadline_ms == 0 ? 0 : mgr->now +
+    (time_t) (deadline_ms > mgr->now_ms ? (deadline_ms - mgr->now_ms) / 1000 :
+              0);
+
+  return result;
+}
+
+// Schedule NS_TIMER event to be sent to the connection when the current
+// time reaches given timestamp. Zero timestamp cancels the timer.
+// Return previously set timestamp. The deadline is kept on the monotonic
+// clock, so stepping the wall clock later does not move it.
+time_t ns_set_timer(struct ns_connection *conn, time_t timestamp) {
+  struct ns_mgr *mgr = conn->mgr;
+  time_t result = conn->ev_timer_time;
+
+  if (timestamp <= 0) {
+    conn->ev_timer_ms = 0;
+  } else if (timestamp <= mgr->now) {
+    conn->ev_timer_ms = mgr->now_ms > 0 ? mgr->now_ms : 1;
+  } else {
+    conn->ev_timer_ms = mgr->now_ms + (uint64_t) (timestamp - mgr->now) * 1000;
+  }
+  conn->ev_timer_time = timestamp;
+
+  return result;
+}
+
+// Pass collected datagrams to the listener's handler, as one NS_UDP_BATCH
+// or as NS_UDP_DATAGRAM each
+static void ns_flush_udp_batch(struct ns_connection *ls,
+                               struct ns_udp_datagram *dgs, int *num) {
+  struct ns_udp_batch batch;
+  int i;
+
+  if (ls->flags & NSF_UDP_BATCH) {
+    batch.datagrams = dgs;
+    batch.num = *num;
+    if (batch.num > 0) ns_call(ls, NS_UDP_BATCH, &batch);
+  } else {
+    for (i = 0; i < *num; i++) ns_call(ls, NS_UDP_DATAGRAM, &dgs[i]);
+  }
+  *num = 0;
+}
+
+static void ns_deliver_udp(struct ns_connection *ls, char *buf, int n,
+                           const union socket_address *sa, time_t now,
+                           struct ns_udp_datagram *dgs, int *num_dgs) {
+  struct ns_connection nc;
+
+  if (ls->flags & (NSF_UDP_DATAGRAM | NSF_UDP_BATCH)) {
+    struct ns_udp_datagram *dg = &dgs[(*num_dgs)++];
+    dg->peer = *sa;
+    dg->data = buf;
+    dg->len = n;
+    dg->session = ls->udp_sessions == NULL ? NULL :
+      ns_udp_session(ls->udp_sessions, sa, now);
+    if (!(ls->flags & NSF_UDP_BATCH) || *num_dgs == NS_UDP_BATCH_SIZE) {
+      ns_flush_udp_batch(ls, dgs, num_dgs);
+    }
+    return;
+  }
+
+  memset(&nc, 0, sizeof(nc));
+  nc.sa = *sa;
+  nc.recv_iobuf.buf = buf;
+  nc.recv_iobuf.len = nc.recv_iobuf.size = n;
+  nc.sock = ls->sock;
+  nc.callback = ls->callback;
+  nc.user_data = ls->user_data;
+  nc.proto_data = ls->proto_data;
+  nc.mgr = ls->mgr;
+  nc.listener = ls;
+  nc.flags = NSF_UDP;
+  DBG(("%p %d bytes received", ls, n));
+  ns_call(&nc, NS_RECV, &n);
+}
+
+// Read datagrams from a UDP listener, passing each one to the callback as
+// NS_RECV. With recvmmsg(), one call reads up to NS_UDP_BATCH_SIZE of them.
+static void ns_handle_udp(struct ns_connection *ls, time_t now) {
+  struct ns_udp_datagram dgs[NS_UDP_BATCH_SIZE];
+  int num_dgs = 0;
+#ifdef NS_ENABLE_MMSG
+  struct mmsghdr msgs[NS_UDP_BATCH_SIZE];
+  struct iovec iov[NS_UDP_BATCH_SIZE];
+  union socket_address sa[NS_UDP_BATCH_SIZE];
+#ifdef NS_ENABLE_UDP_OFFLOAD
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl[NS_UDP_BATCH_SIZE];
+  struct cmsghdr *cmsg;
+#endif
+  struct ns_mgr *mgr = ls->mgr;
+  size_t buf_size = NS_UDP_RECEIVE_BUFFER_SIZE, seg_size, j;
+  int i, n, num_msgs = NS_UDP_BATCH_SIZE;
+  char *p;
+
+  if (ls->flags & NSF_UDP_GRO) {
+    buf_size = NS_UDP_GRO_BUFFER_SIZE;
+    num_msgs = NS_UDP_GRO_BATCH_SIZE < NS_UDP_BATCH_SIZE ?
+      NS_UDP_GRO_BATCH_SIZE : NS_UDP_BATCH_SIZE;
+  }
+  if (mgr->udp_buf_size < num_msgs * buf_size) {
+    if ((p = (char *) NS_REALLOC(mgr->udp_buf, num_msgs * buf_size)) == NULL) {
+      return;
+    }
+    mgr->udp_buf = p;
+    mgr->udp_buf_size = num_msgs * buf_size;
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < num_msgs; i++) {
+    iov[i].iov_base = mgr->udp_buf + i * buf_size;
+    iov[i].iov_len = buf_size;
+    msgs[i].msg_hdr.msg_name = &sa[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(sa[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef NS_ENABLE_UDP_OFFLOAD
+    if (ls->flags & NSF_UDP_GRO) {
+      msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+    }
+#endif
+  }
+
+  n = recvmmsg(ls->sock, msgs, num_msgs, MSG_DONTWAIT, NULL);
+  if (n <= 0) {
+    DBG(("%p recvmmsg: %s", ls, strerror(errno)));
+  }
+  for (i = 0; i < n; i++) {
+    // A coalesced read holds datagrams of seg_size bytes, last may be shorter
+    seg_size = msgs[i].msg_len;
+#ifdef NS_ENABLE_UDP_OFFLOAD
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        if (gso_size > 0) seg_size = gso_size;
+      }
+    }
+#endif
+    for (j = 0; j < msgs[i].msg_len; j += seg_size) {
+      size_t len = msgs[i].msg_len - j < seg_size ?
+        msgs[i].msg_len - j : seg_size;
+      ns_deliver_udp(ls, (char *) iov[i].iov_base + j, (int) len, &sa[i],
+                     now, dgs, &num_dgs);
+    }
+  }
+#else
+  char buf[NS_UDP_RECEIVE_BUFFER_SIZE];
+  union socket_address sa;
+  socklen_t s_len = sizeof(sa);
+  int n;
+
+  n = recvfrom(ls->sock, buf, sizeof(buf), 0, &sa.sa, &s_len);
+  if (n <= 0) {
+    DBG(("%p recvfrom: %s", ls, strerror(errno)));
+  } else {
+    ns_deliver_udp(ls, buf, n, &sa, now, dgs, &num_dgs);
+  }
+#endif
+  ns_flush_udp_batch(ls, dgs, &num_dgs);
+}
+
+// Messages from other threads travel through an intrusive multi-producer,
+// single-consumer queue (Vyukov's algorithm): producers only swap ctl_head,
+// the event loop pops from ctl_tail. A producer wakes up ns_mgr_poll() only
+// if no wakeup is pending already, so bursts cost one syscall.
+static void ns_ctl_push(struct ns_mgr *mgr, struct ns_ctl_msg *msg) {
+  struct ns_ctl_msg *prev;
+
+  msg->next = NULL;
+  prev = (struct ns_ctl_msg *) ns_atomic_xchg_ptr(&mgr->ctl_head, msg);
+  ns_atomic_store_ptr(&prev->next, msg);
+
+  if (ns_atomic_xchg_int(&mgr->ctl_wakeup_pending, 1) == 0 &&
+      mgr->ctl[0] != INVALID_SOCKET) {
+#ifdef NS_ENABLE_EVENTFD
+    uint64_t one = 1;
+    if (write(mgr->ctl[0], &one, sizeof(one)) < 0) {
+      DBG(("%p eventfd write: %d", mgr, errno));
+    }
+#else
+    send(mgr->ctl[0], "", 1, 0);
+#endif
+  }
+}
+
+// Return the oldest message, or NULL if the queue is empty. NULL is also
+// returned while a producer is in the middle of ns_ctl_push(); that producer
+// sends a wakeup when it finishes.
+static struct ns_ctl_msg *ns_ctl_pop(struct ns_mgr *mgr) {
+  struct ns_ctl_msg *tail = mgr->ctl_tail, *next, *head;
+
+  next = (struct ns_ctl_msg *) ns_atomic_load_ptr(&tail->next);
+  if (tail == &mgr->ctl_stub) {
+    if (next == NULL) return NULL;
+    mgr->ctl_tail = tail = next;
+    next = (struct ns_ctl_msg *) ns_atomic_load_ptr(&tail->next);
+  }
+  if (next != NULL) {
+    mgr->ctl_tail = next;
+    return tail;
+  }
+  head = (struct ns_ctl_msg *) ns_atomic_load_ptr(&mgr->ctl_head);
+  if (tail != head) return NULL;
+  // tail is the last message: put the stub behind it to detach it
+  mgr->ctl_stub.next = NULL;
+  head = (struct ns_ctl_msg *) ns_atomic_xchg_ptr(&mgr->ctl_head,
+                                                  &mgr->ctl_stub);
+  ns_atomic_store_ptr(&head->next, &mgr->ctl_stub);
+  next = (struct ns_ctl_msg *) ns_atomic_load_ptr(&tail->next);
+  if (next != NULL) {
+    mgr->ctl_tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+// Run queued messages against every connection
+static void ns_ctl_run(struct ns_mgr *mgr) {
+  struct ns_ctl_msg *msg;
+  struct ns_connection *c;
+
+  while ((msg = ns_ctl_pop(mgr)) != NULL) {
+    if (msg->is_targeted) {
+      // Connection may have gone away since ns_post()
+      if ((c = ns_handle_conn(mgr, msg->target)) != NULL) {
+        msg->callback(c, NS_POLL, msg->data);
+      }
+    } else {
+      for (c = mgr->active_connections; c != NULL; c = c->next) {
+        msg->callback(c, NS_POLL, msg->data);
+      }
+    }
+    if (msg->is_async) {
+      NS_FREE(msg);
+    } else {
+      // Sender owns msg and may return as soon as it sees done
+      ns_mutex_lock(&mgr->ctl_lock);
+      msg->done = 1;
+      ns_cond_broadcast(&mgr->ctl_done);
+      ns_mutex_unlock(&mgr->ctl_lock);
+    }
+  }
+}
+
+static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
+  if (sock != INVALID_SOCKET) {
+    FD_SET(sock, set);
+    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
+      *max_fd = sock;
+    }
+  }
+}
+
+time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
+  struct ns_connection *conn;
+  unsigned int id;
+  struct timeval tv;
+  fd_set read_set, write_set;
+  sock_t max_fd = INVALID_SOCKET;
+  uint64_t next_timer = 0;
+  time_t current_time;
+
+  ns_update_time(mgr);
+  current_time = mgr->now;
+  FD_ZERO(&read_set);
+  FD_ZERO(&write_set);
+  ns_add_to_set(mgr->ctl[1], &read_set, &max_fd);
+#ifdef NS_ENABLE_SSL
+  if (mgr->ssl_workers != NULL) {
+    ns_add_to_set(mgr->ssl_workers->wakeup[1], &read_set, &max_fd);
+  }
+#endif
+
+  for (id = 0; (conn = ns_scan_conns(mgr, &id)) != NULL;) {
+    if (conn->flags & NSF_SSL_OFFLOADED) {
+      continue;  // SSL worker owns the connection, don't poll or close it
+    }
+    if (!(conn->flags & (NSF_LISTENING | NSF_CONNECTING))) {
+      ns_call(conn, NS_POLL, &current_time);
+    }
+    if (conn->ev_timer_ms > 0 && mgr->now_ms >= conn->ev_timer_ms) {
+      conn->ev_timer_ms = 0;
+      conn->ev_timer_time = 0;
+      ns_call(conn, NS_TIMER, &current_time);
+    }
+    if (conn->ev_timer_ms > 0 &&
+        (next_timer == 0 || conn->ev_timer_ms < next_timer)) {
+      next_timer = conn->ev_timer_ms;
+    }
+    // Flag is set by ns_set_udp_sessions(), so other connections don't
+    // touch the cold udp_sessions field
+    if ((conn->flags & NSF_UDP_DATAGRAM) && conn->udp_sessions != NULL) {
+      ns_udp_expire_sessions(conn, current_time);
+    }
+    if (conn->flags & NSF_RESOLVING) {
+      continue;  // No address to connect or send to yet
+    }
+    if (!(conn->flags & (NSF_WANT_WRITE | NSF_DONT_RECV))) {
+      //DBG(("%p read_set", conn));
+      ns_add_to_set(conn->sock, &read_set, &max_fd);
+    }
+    if (((conn->flags & NSF_CONNECTING) && !(conn->flags & NSF_WANT_READ)) ||
+        (conn->send_iobuf.len > 0 && !(conn->flags & NSF_CONNECTING) &&
+         !(conn->flags & NSF_BUFFER_BUT_DONT_SEND))) {
+      //DBG(("%p write_set", conn));
+      ns_add_to_set(conn->sock, &write_set, &max_fd);
+    }
+    if (conn->flags & NSF_CLOSE_IMMEDIATELY) {
+      ns_close_conn(conn);
+    }
+  }
+
+  // Don't sleep past the nearest timer
+  if (next_timer > 0) {
+    uint64_t wait = next_timer > mgr->now_ms ? next_timer - mgr->now_ms : 0;
+    if (wait < (uint64_t) milli) milli = (int) wait;
+  }
+  tv.tv_sec = milli / 1000;
+  tv.tv_usec = (milli % 1000) * 1000;
+
+  if (select((int) max_fd + 1, &read_set, &write_set, NULL, &tv) > 0) {
+    // select() might have been waiting for a long time, reset current_time
+    // now to prevent last_io_time being set to the past.
+    ns_update_time(mgr);
+    current_time = mgr->now;
+
+    // Consume the wakeup, messages are handled below
+    if (mgr->ctl[1] != INVALID_SOCKET &&
+        FD_ISSET(mgr->ctl[1], &read_set)) {
+#ifdef NS_ENABLE_EVENTFD
+      uint64_t n;
+      if (read(mgr->ctl[1], &n, sizeof(n)) < 0) {
+        DBG(("%p eventfd read: %d", mgr, errno));
+      }
+#else
+      char buf[1];
+      recv(mgr->ctl[1], buf, sizeof(buf), 0);
+#endif
+      ns_atomic_xchg_int(&mgr->ctl_wakeup_pending, 0);
+    }
+
+#ifdef NS_ENABLE_SSL
+    if (mgr->ssl_workers != NULL &&
+        FD_ISSET(mgr->ssl_workers->wakeup[1], &read_set)) {
+      ns_ssl_collect_jobs(mgr->ssl_workers);
+    }
+#endif
+
+    for (id = 0; (conn = ns_scan_conns(mgr, &id)) != NULL;) {
+      if (conn->flags & NSF_SSL_OFFLOADED) continue;
+      if (FD_ISSET(conn->sock, &read_set)) {
+        if (conn->flags & NSF_LISTENING) {
+          if (conn->flags & NSF_UDP) {
+            ns_handle_udp(conn, current_time);
+          } else {
+            ns_accept_conns(conn);
+          }
+        } else {
+          conn->last_io_time = current_time;
+          conn->last_io_ms = mgr->now_ms;
+          ns_read_from_socket(conn);
+        }
+      }
+
+      // Read may have just handed the handshake to an SSL worker
+      if (conn->flags & NSF_SSL_OFFLOADED) continue;
+
+      if (FD_ISSET(conn->sock, &write_set)) {
+        if (conn->flags & NSF_CONNECTING) {
+          ns_read_from_socket(conn);
+        } else if (!(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
+          conn->last_io_time = current_time;
+          conn->last_io_ms = mgr->now_ms;
+          ns_write_to_socket(conn);
+        }
+      }
+    }
+  }
+
+  // Without a wakeup fd, messages wait for the next poll
+  ns_ctl_run(mgr);
+
+  for (id = 0; (conn = ns_scan_conns(mgr, &id)) != NULL;) {
+    if (!(conn->flags & NSF_SSL_OFFLOADED) &&
+        ((conn->flags & NSF_CLOSE_IMMEDIATELY) ||
+         (conn->send_iobuf.len == 0 &&
+          (conn->flags & NSF_FINISHED_SENDING_DATA)))) {
+      ns_close_conn(conn);
+    }
+  }
+
+  return current_time;
+}
+
+// Asynchronous DNS resolver. Every query is sent from its own UDP connection,
+// so replies and timeouts are handled by ns_mgr_poll() like any other IO.
+// Names listed in the hosts file are answered without DNS; the file is read
+// once per manager, like the servers from resolv.conf.
+// Answers are cached per manager for their TTL. Names that do not exist are
+// cached too, and expired entries are served for up to NS_DNS_STALE_TTL
+// seconds while a background query refreshes them.
+struct ns_dns_query {
+  struct ns_dns_query *next;
+  uint16_t id;                      // Random DNS transaction ID
+  int qtype;                        // NS_DNS_A or NS_DNS_AAAA
+  int attempts;                     // Queries sent so far
+  struct ns_connection *nc;         // Socket of the current attempt
+  ns_resolve_cb_t cb;               // User callback, or
+  int has_conn;                     // ns_connect() waiting for the name
+  int waiting;                      // Not sent, rides on the same name query
+  struct ns_handle conn;
+  void *user_data;
+  char name[256];
+};
+
+struct ns_dns_cache_entry {
+  struct ns_dns_cache_entry *next;  // Hash bucket linkage
+  int qtype;
+  int negative;                     // Name has no such record
+  int refreshing;                   // Query for the expired entry is sent
+  uint64_t expires;                 // Fresh until ns_mgr::now_ms is there
+  union socket_address addr;
+  char name[256];
+};
+
+// Address from the hosts file
+struct ns_dns_host {
+  struct ns_dns_host *next;
+  int qtype;                        // NS_DNS_A or NS_DNS_AAAA
+  union socket_address addr;
+  char name[1];                     // Allocated to fit the name
+};
+
+#define NS_DNS_CACHE_BUCKETS 64
+#define NS_DNS_MAX_QUERY_SIZE 300
+#define NS_DNS_BIND_ATTEMPTS 5      // Random source ports tried per query
+
+struct ns_dns {
+  struct ns_dns_query *queries;     // Waiting for replies
+  union socket_address servers[NS_DNS_MAX_SERVERS];
+  int num_servers;
+  struct ns_dns_host *hosts;        // In file order
+  struct ns_dns_cache_entry *cache[NS_DNS_CACHE_BUCKETS];
+  struct ns_dns_stats stats;
+};
+
+static int ns_dns_name_eq(const char *a, const char *b) {
+  size_t n = strlen(a);
+  return n == strlen(b) && ns_ncasecmp(a, b, n) == 0;
+}
+
+static struct ns_dns_cache_entry **ns_dns_bucket(struct ns_dns *dns,
+                                                 const char *name) {
+  unsigned int h = 2166136261U;  // FNV-1a over the lowercase name
+  for (; *name != '\0'; name++) {
+    h = (h ^ (unsigned char) tolower(* (unsigned char *) name)) * 16777619U;
+  }
+  return &dns->cache[h % NS_DNS_CACHE_BUCKETS];
+}
+
+static struct ns_dns_cache_entry *ns_dns_cache_find(struct ns_dns *dns,
+                                                    const char *name,
+                                                    int qtype) {
+  struct ns_dns_cache_entry *e = *ns_dns_bucket(dns, name);
+  while (e != NULL && (e->qtype != qtype || !ns_dns_name_eq(e->name, name))) {
+    e = e->next;
+  }
+  return e;
+}
+
+// Drop the entry that expires first, to make room for a new one
+static void ns_dns_cache_evict(struct ns_dns *dns) {
+  struct ns_dns_cache_entry **p, **victim = NULL, *e;
+  int i;
+
+  for (i = 0; i < NS_DNS_CACHE_BUCKETS; i++) {
+    for (p = &dns->cache[i]; *p != NULL; p = &(*p)->next) {
+      if (victim == NULL || (*p)->expires < (*victim)->expires) victim = p;
+    }
+  }
+  if (victim != NULL) {
+    e = *victim;
+    *victim = e->next;
+    NS_FREE(e);
+    dns->stats.num_entries--;
+  }
+}
+
+// Remember the result of a query. sa is NULL if the name does not exist.
+static void ns_dns_cache_store(struct ns_mgr *mgr, const char *name,
+                               int qtype, union socket_address *sa,
+                               uint32_t ttl) {
+  struct ns_dns *dns = mgr->dns;
+  struct ns_dns_cache_entry *e, **bucket;
+
+  if ((e = ns_dns_cache_find(dns, name, qtype)) == NULL) {
+    if (dns->stats.num_entries >= NS_DNS_CACHE_SIZE) ns_dns_cache_evict(dns);
+    if ((e = (struct ns_dns_cache_entry *) NS_MALLOC(sizeof(*e))) == NULL) {
+      return;
+    }
+    memset(e, 0, sizeof(*e));
+    e->qtype = qtype;
+    strcpy(e->name, name);
+    bucket = ns_dns_bucket(dns, name);
+    e->next = *bucket;
+    *bucket = e;
+    dns->stats.num_entries++;
+  }
+
+  if (sa == NULL) {
+    ttl = NS_DNS_NEGATIVE_TTL;
+  } else if (ttl > NS_DNS_MAX_TTL) {
+    ttl = NS_DNS_MAX_TTL;
+  }
+  e->negative = sa == NULL;
+  if (sa != NULL) e->addr = *sa;
+  e->refreshing = 0;
+  e->expires = mgr->now_ms + (uint64_t) ttl * 1000;
+}
+
+static void ns_dns_cache_free(struct ns_dns *dns) {
+  struct ns_dns_cache_entry *e;
+  int i;
+
+  for (i = 0; i < NS_DNS_CACHE_BUCKETS; i++) {
+    while ((e = dns->cache[i]) != NULL) {
+      dns->cache[i] = e->next;
+      NS_FREE(e);
+    }
+  }
+  dns->stats.num_entries = 0;
+}
+
+static int ns_dns_start(struct ns_mgr *, const char *, int, ns_resolve_cb_t,
+                        void *, struct ns_connection *);
+
+// Look "name" up in the cache. Return 1 and fill the address in sa (keeping
+// its port) if it is known, -1 if the name is known not to exist, 0 if it
+// has to be queried. A stale entry is returned and refreshed in background.
+static int ns_dns_lookup_cache(struct ns_mgr *mgr, const char *name,
+                               int qtype, union socket_address *sa) {
+  struct ns_dns_cache_entry *e;
+  uint64_t now = mgr->now_ms;
+
+  if (mgr->dns == NULL ||
+      (e = ns_dns_cache_find(mgr->dns, name, qtype)) == NULL ||
+      now >= e->expires + (e->negative ? 0 : NS_DNS_STALE_TTL * 1000)) {
+    return 0;
+  }
+
+  if (now >= e->expires) {
+    mgr->dns->stats.stale_hits++;
+    if (!e->refreshing && ns_dns_start(mgr, name, qtype, NULL, NULL,
+                                       NULL) == 0) {
+      e->refreshing = 1;
+    }
+  } else if (e->negative) {
+    mgr->dns->stats.negative_hits++;
+  } else {
+    mgr->dns->stats.hits++;
+  }
+  if (e->negative) return -1;
+
+  if (qtype == NS_DNS_A) {
+    sa->sin.sin_family = AF_INET;
+    sa->sin.sin_addr = e->addr.sin.sin_addr;
+#ifdef NS_ENABLE_IPV6
+  } else {
+    sa->sin6.sin6_family = AF_INET6;
+    sa->sin6.sin6_addr = e->addr.sin6.sin6_addr;
+#endif
+  }
+
+  return 1;
+}
+
+static struct ns_dns *ns_dns_get(struct ns_mgr *mgr);
+
+// Look "name" up in the hosts file, store address in sa keeping its port
+static int ns_dns_lookup_hosts(struct ns_mgr *mgr, const char *name,
+                               int qtype, union socket_address *sa) {
+  struct ns_dns *dns = ns_dns_get(mgr);
+  struct ns_dns_host *h;
+
+  for (h = dns == NULL ? NULL : dns->hosts; h != NULL; h = h->next) {
+    if (h->qtype != qtype || !ns_dns_name_eq(h->name, name)) continue;
+    if (qtype == NS_DNS_A) {
+      sa->sin.sin_family = AF_INET;
+      sa->sin.sin_addr = h->addr.sin.sin_addr;
+#ifdef NS_ENABLE_IPV6
+    } else {
+      sa->sin6.sin6_family = AF_INET6;
+      sa->sin6.sin6_addr = h->addr.sin6.sin6_addr;
+#endif
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+static void ns_dns_add_host(struct ns_dns_host ***tail, const char *name,
+                            int qtype, const union socket_address *addr) {
+  struct ns_dns_host *h;
+
+  if ((h = (struct ns_dns_host *) NS_MALLOC(sizeof(*h) +
+                                            strlen(name))) != NULL) {
+    h->next = NULL;
+    h->qtype = qtype;
+    h->addr = *addr;
+    strcpy(h->name, name);
+    **tail = h;
+    *tail = &h->next;
+  }
+}
+
+static void ns_dns_load_hosts(struct ns_dns *dns) {
+  struct ns_dns_host **tail = &dns->hosts;
+  union socket_address sa;
+  char line[512], ip[100], host[256], *p;
+  int ofs, n, qtype;
+  FILE *fp;
+
+  if ((fp = fopen(NS_HOSTS_FILE, "r")) == NULL) return;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if ((p = strchr(line, '#')) != NULL) *p = '\0';
+    if (sscanf(line, "%99s%n", ip, &ofs) != 1) continue;
+    memset(&sa, 0, sizeof(sa));
+    if (inet_pton(AF_INET, ip, &sa.sin.sin_addr) == 1) {
+      qtype = NS_DNS_A;
+#ifdef NS_ENABLE_IPV6
+    } else if (inet_pton(AF_INET6, ip, &sa.sin6.sin6_addr) == 1) {
+      qtype = NS_DNS_AAAA;
+#endif
+    } else {
+      continue;
+    }
+    while (sscanf(line + ofs, "%255s%n", host, &n) == 1) {
+      ofs += n;
+      ns_dns_add_host(&tail, host, qtype, &sa);
+    }
+  }
+  fclose(fp);
+}
+
+static void ns_dns_free_hosts(struct ns_dns *dns) {
+  struct ns_dns_host *h;
+
+  while ((h = dns->hosts) != NULL) {
+    dns->hosts = h->next;
+    NS_FREE(h);
+  }
+}
+
+// Address is IP[:PORT], or [IPv6]:PORT or a bare IPv6 address
+static void ns_dns_add_server(struct ns_dns *dns, const char *addr) {
+  union socket_address *sa = &dns->servers[dns->num_servers];
+  unsigned int a, b, c, d, port = 53;
+#ifdef NS_ENABLE_IPV6
+  char buf[100];
+#endif
+
+  if (dns->num_servers >= NS_DNS_MAX_SERVERS) return;
+  memset(sa, 0, sizeof(*sa));
+  if (sscanf(addr, "%u.%u.%u.%u:%u", &a, &b, &c, &d, &port) >= 4) {
+    sa->sin.sin_family = AF_INET;
+    sa->sin.sin_addr.s_addr = htonl((a << 24) | (b << 16) | (c << 8) | d);
+    sa->sin.sin_port = htons((uint16_t) port);
+    dns->num_servers++;
+#ifdef NS_ENABLE_IPV6
+  } else if ((sscanf(addr, "[%99[^]]]:%u", buf, &port) >= 1 ||
+              sscanf(addr, "%99[0-9a-fA-F:.]", buf) == 1) &&
+             inet_pton(AF_INET6, buf, &sa->sin6.sin6_addr) == 1) {
+    sa->sin6.sin6_family = AF_INET6;
+    sa->sin6.sin6_port = htons((uint16_t) port);
+    dns->num_servers++;
+#endif
+  }
+}
+
+// Use ns_mgr::nameserver if set, otherwise servers from resolv.conf. With
+// neither, lookups fail: queries never go to a server nobody configured.
+static void ns_dns_load_servers(struct ns_mgr *mgr, struct ns_dns *dns) {
+  char line[256], addr[100];
+  FILE *fp;
+
+  if (mgr->nameserver != NULL) {
+    ns_dns_add_server(dns, mgr->nameserver);
+  } else if ((fp = fopen(NS_RESOLV_CONF, "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (sscanf(line, " nameserver %99s", addr) == 1) {
+        ns_dns_add_server(dns, addr);
+      }
+    }
+    fclose(fp);
+  }
+}
+
+static struct ns_dns *ns_dns_get(struct ns_mgr *mgr) {
+  struct ns_dns *dns = mgr->dns;
+
+  if (dns == NULL &&
+      (dns = (struct ns_dns *) NS_MALLOC(sizeof(*dns))) != NULL) {
+    memset(dns, 0, sizeof(*dns));
+    ns_dns_load_servers(mgr, dns);
+    ns_dns_load_hosts(dns);
+    mgr->dns = dns;
+  }
+
+  return dns;
+}
+
+// Build a query packet, return its length or -1 if the name is invalid
+static int ns_dns_encode_query(unsigned char *buf, size_t size, uint16_t id,
+                               const char *name, int qtype) {
+  const char *s = name, *dot;
+  size_t n, len = 12;
+
+  memset(buf, 0, 12);
+  buf[0] = (unsigned char) (id >> 8);
+  buf[1] = (unsigned char) id;
+  buf[2] = 0x01;  // Recursion desired
+  buf[5] = 1;     // One question
+
+  while (*s != '\0') {
+    n = (dot = strchr(s, '.')) == NULL ? strlen(s) : (size_t) (dot - s);
+    if (n == 0 || n > 63 || len + n + 1 + 5 > size) return -1;
+    buf[len++] = (unsigned char) n;
+    memcpy(buf + len, s, n);
+    len += n;
+    s += n;
+    if (*s == '.') s++;
+  }
+  if (len == 12) return -1;
+  buf[len++] = 0;
+  buf[len++] = (unsigned char) (qtype >> 8);
+  buf[len++] = (unsigned char) qtype;
+  buf[len++] = 0;
+  buf[len++] = 1;  // Class IN
+
+  return (int) len;
+}
+
+// Decode a possibly compressed name at buf[ofs] into dst. Return offset
+// past the name as stored at ofs, or -1 if the message is malformed.
+static int ns_dns_read_name(const unsigned char *buf, int len, int ofs,
+                            char *dst, size_t dst_len) {
+  int end = -1, jumps = 0, n;
+  size_t i = 0;
+
+  for (;;) {
+    if (ofs >= len) return -1;
+    n = buf[ofs];
+    if ((n & 0xc0) == 0xc0) {
+      if (ofs + 1 >= len || ++jumps > 16) return -1;
+      if (end < 0) end = ofs + 2;
+      ofs = ((n & 0x3f) << 8) | buf[ofs + 1];
+      continue;
+    }
+    if (n == 0) break;
+    if (ofs + 1 + n > len || i + n + 2 > dst_len) return -1;
+    if (i > 0) dst[i++] = '.';
+    memcpy(dst + i, buf + ofs + 1, n);
+    i += n;
+    ofs += n + 1;
+  }
+  dst[i] = '\0';
+
+  return end < 0 ? ofs + 1 : end;
+}
+
+// Parse a reply to q. Return 1 and fill sa (and ttl) if it has an answer,
+// 0 if the name has no such record, -1 if the reply is not for q or the
+// server failed.
+static int ns_dns_parse_reply(const unsigned char *buf, int len,
+                              const struct ns_dns_query *q,
+                              union socket_address *sa, uint32_t *ttl) {
+  char name[256];
+  int i, ofs, type, rdlen, num_answers, rcode;
+
+  if (len < 12 || ((buf[0] << 8) | buf[1]) != q->id || !(buf[2] & 0x80) ||
+      ((buf[4] << 8) | buf[5]) != 1) {
+    return -1;
+  }
+  if ((ofs = ns_dns_read_name(buf, len, 12, name, sizeof(name))) < 0 ||
+      ofs + 4 > len || strlen(name) != strlen(q->name) ||
+      ns_ncasecmp(name, q->name, strlen(name)) != 0 ||
+      ((buf[ofs] << 8) | buf[ofs + 1]) != q->qtype) {
+    return -1;
+  }
+  ofs += 4;
+
+  rcode = buf[3] & 0x0f;
+  if (rcode == 3) return 0;   // NXDOMAIN
+  if (rcode != 0) return -1;  // Let another server try
+
+  num_answers = (buf[6] << 8) | buf[7];
+  for (i = 0; i < num_answers; i++) {
+    if ((ofs = ns_dns_read_name(buf, len, ofs, name, sizeof(name))) < 0 ||
+        ofs + 10 > len) {
+      return -1;
+    }
+    type = (buf[ofs] << 8) | buf[ofs + 1];
+    *ttl = ((uint32_t) buf[ofs + 4] << 24) | (buf[ofs + 5] << 16) |
+      (buf[ofs + 6] << 8) | buf[ofs + 7];
+    rdlen = (buf[ofs + 8] << 8) | buf[ofs + 9];
+    ofs += 10;
+    if (ofs + rdlen > len) return -1;
+    // CNAME chains are followed by the server, just pick the address
+    if (type == NS_DNS_A && type == q->qtype && rdlen == 4) {
+      sa->sin.sin_family = AF_INET;
+      memcpy(&sa->sin.sin_addr, buf + ofs, 4);
+      return 1;
+#ifdef NS_ENABLE_IPV6
+    } else if (type == NS_DNS_AAAA && type == q->qtype && rdlen == 16) {
+      sa->sin6.sin6_family = AF_INET6;
+      memcpy(&sa->sin6.sin6_addr, buf + ofs, 16);
+      return 1;
+#endif
+    }
+    ofs += rdlen;
+  }
+
+  return 0;
+}
+
+// Finish a connection that waited for its host name. sa is NULL on failure.
+static void ns_dns_connect_done(struct ns_connection *nc,
+                                union socket_address *sa) {
+  int rc, err = -1;
+
+  nc->flags &= ~NSF_RESOLVING;
+  if (sa != NULL) {
+    nc->sa.sin.sin_addr = sa->sin.sin_addr;
+    if (nc->flags & NSF_UDP) {
+      return;  // Queued datagrams go out on the next poll
+    }
+#ifdef NS_ENABLE_SSL
+    if (nc->ssl != NULL) ns_resume_client_ssl_session(nc);
+#endif
+    rc = connect(nc->sock, &nc->sa.sa, sizeof(nc->sa.sin));
+    if (rc == 0 || !ns_is_error(rc)) return;  // ns_mgr_poll() takes over
+    err = errno;
+  }
+  nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  if (!(nc->flags & NSF_UDP)) {
+    ns_call(nc, NS_CONNECT, &err);
+  }
+}
+
+// Stop reading replies for q, its socket is closed by the next poll
+static void ns_dns_detach(struct ns_dns_query *q) {
+  if (q->nc != NULL) {
+    q->nc->user_data = NULL;
+    q->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    q->nc = NULL;
+  }
+}
 
-  ns_call(conn, NS_SEND, &n);
-  if (ns_is_error(n)) {
-    conn->flags |= NSF_CLOSE_IMMEDIATELY;
-  } else if (n > 0) {
-    iobuf_remove(io, n);
+static void ns_dns_finish(struct ns_mgr *mgr, struct ns_dns_query *q,
+                          union socket_address *sa) {
+  struct ns_connection *nc;
+
+  ns_dns_detach(q);
+  if (q->cb != NULL) {
+    q->cb(mgr, q->name, sa, q->user_data);
+  } else if (q->has_conn && (nc = ns_handle_conn(mgr, q->conn)) != NULL) {
+    ns_dns_connect_done(nc, sa);
   }
+  // Otherwise it is a refresh of a stale entry, only the cache is updated
+  NS_FREE(q);
 }
 
-int ns_send(struct ns_connection *conn, const void *buf, int len) {
-  return (int) ns_out(conn, buf, len);
+static void ns_dns_unlink(struct ns_dns *dns, struct ns_dns_query *q) {
+  struct ns_dns_query **p;
+  for (p = &dns->queries; *p != NULL; p = &(*p)->next) {
+    if (*p == q) {
+      *p = q->next;
+      break;
+    }
+  }
 }
 
-static void ns_handle_udp(struct ns_connection *ls) {
-  struct ns_connection nc;
-  char buf[NS_UDP_RECEIVE_BUFFER_SIZE];
-  int n;
-  socklen_t s_len = sizeof(nc.sa);
+// Finish q and all queries waiting for the same name. res is the result of
+// ns_dns_parse_reply(), or -1 if no server replied.
+static void ns_dns_complete(struct ns_mgr *mgr, struct ns_dns_query *q,
+                            int res, union socket_address *sa, uint32_t ttl) {
+  struct ns_dns *dns = mgr->dns;
+  struct ns_dns_query *w, *done = q, **p;
+  struct ns_dns_cache_entry *e;
+
+  if (res >= 0) {
+    ns_dns_cache_store(mgr, q->name, q->qtype, res > 0 ? sa : NULL, ttl);
+  } else if ((e = ns_dns_cache_find(dns, q->name, q->qtype)) != NULL) {
+    e->refreshing = 0;  // Keep serving the stale entry, retry later
+  }
 
-  memset(&nc, 0, sizeof(nc));
-  n = recvfrom(ls->sock, buf, sizeof(buf), 0, &nc.sa.sa, &s_len);
-  if (n <= 0) {
-    DBG(("%p recvfrom: %s", ls, strerror(errno)));
-  } else {
-    nc.mgr = ls->mgr;
-    nc.recv_iobuf.buf = buf;
-    nc.recv_iobuf.len = nc.recv_iobuf.size = n;
-    nc.sock = ls->sock;
-    nc.callback = ls->callback;
-    nc.user_data = ls->user_data;
-    nc.proto_data = ls->proto_data;
-    nc.mgr = ls->mgr;
-    nc.listener = ls;
-    nc.flags = NSF_UDP;
-    DBG(("%p %d bytes received", ls, n));
-    ns_call(&nc, NS_RECV, &n);
+  // Collect q and its waiters first, callbacks may start new queries
+  ns_dns_unlink(dns, q);
+  q->next = NULL;
+  for (p = &dns->queries; (w = *p) != NULL;) {
+    if (w->waiting && w->qtype == q->qtype && ns_dns_name_eq(w->name,
+                                                             q->name)) {
+      *p = w->next;
+      w->next = done;
+      done = w;
+    } else {
+      p = &w->next;
+    }
+  }
+  for (; done != NULL; done = w) {
+    w = done->next;
+    ns_dns_finish(mgr, done, res > 0 ? sa : NULL);
   }
 }
 
-static void ns_add_to_set(sock_t sock, fd_set *set, sock_t *max_fd) {
-  if (sock != INVALID_SOCKET) {
-    FD_SET(sock, set);
-    if (*max_fd == INVALID_SOCKET || sock > *max_fd) {
-      *max_fd = sock;
-    }
+static void ns_dns_handler(struct ns_connection *, int, void *);
+
+// Open a socket for one query attempt. It is bound to a random port and
+// connected to the server, so the kernel drops datagrams from anyone else
+// and a spoofed reply has to guess the port as well as the ID (RFC 5452).
+static struct ns_connection *ns_dns_open(struct ns_mgr *mgr,
+                                         const union socket_address *server,
+                                         struct ns_dns_query *q) {
+  struct ns_connection *nc;
+  union socket_address sa;
+  uint16_t port;
+  sock_t sock;
+  int i;
+
+  sock = socket(server->sa.sa_family, SOCK_DGRAM, 0);
+  if (sock == INVALID_SOCKET) return NULL;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa.sa_family = server->sa.sa_family;
+  for (i = 0; i < NS_DNS_BIND_ATTEMPTS; i++) {
+    if (ns_random(mgr, &port, sizeof(port)) != 0) break;
+    port = htons((uint16_t) (1024 + port % (65536 - 1024)));
+#ifdef NS_ENABLE_IPV6
+    if (sa.sa.sa_family == AF_INET6) sa.sin6.sin6_port = port;
+#endif
+    if (sa.sa.sa_family == AF_INET) sa.sin.sin_port = port;
+    if (bind(sock, &sa.sa, ns_sa_len(&sa)) == 0) break;
+  }
+  // If every random port was taken, connect() picks an ephemeral one
+  if (connect(sock, &server->sa, ns_sa_len(server)) != 0 ||
+      (nc = ns_add_sock(mgr, sock, ns_dns_handler, q)) == NULL) {
+    closesocket(sock);
+    return NULL;
   }
+  nc->sa = *server;
+  nc->flags = NSF_UDP;
+
+  return nc;
 }
 
-time_t ns_mgr_poll(struct ns_mgr *mgr, int milli) {
-  struct ns_connection *conn, *tmp_conn;
-  struct timeval tv;
-  fd_set read_set, write_set;
-  sock_t max_fd = INVALID_SOCKET;
-  time_t current_time = time(NULL);
+// Send q to the next server in turn from a new socket. Return -1 if there
+// is no server or the socket can't be opened. The name is checked by
+// ns_dns_start().
+static int ns_dns_send(struct ns_mgr *mgr, struct ns_dns_query *q) {
+  struct ns_dns *dns = mgr->dns;
+  unsigned char buf[NS_DNS_MAX_QUERY_SIZE];
+  int len = ns_dns_encode_query(buf, sizeof(buf), q->id, q->name, q->qtype);
+
+  if (dns->num_servers == 0) return -1;
+  ns_dns_detach(q);
+  q->nc = ns_dns_open(mgr, &dns->servers[q->attempts++ % dns->num_servers],
+                      q);
+  if (q->nc == NULL) return -1;
+  ns_set_timer_ms(q->nc, mgr->now_ms + NS_DNS_TIMEOUT * 1000);
+  // A datagram the kernel refuses is handled like a lost one
+  send(q->nc->sock, (const char *) buf, len, 0);
+  dns->stats.queries_sent++;
 
-  FD_ZERO(&read_set);
-  FD_ZERO(&write_set);
-  ns_add_to_set(mgr->ctl[1], &read_set, &max_fd);
+  return 0;
+}
 
-  for (conn = mgr->active_connections; conn != NULL; conn = tmp_conn) {
-    tmp_conn = conn->next;
-    if (!(conn->flags & (NSF_LISTENING | NSF_CONNECTING))) {
-      ns_call(conn, NS_POLL, &current_time);
-    }
-    if (!(conn->flags & NSF_WANT_WRITE)) {
-      //DBG(("%p read_set", conn));
-      ns_add_to_set(conn->sock, &read_set, &max_fd);
-    }
-    if (((conn->flags & NSF_CONNECTING) && !(conn->flags & NSF_WANT_READ)) ||
-        (conn->send_iobuf.len > 0 && !(conn->flags & NSF_CONNECTING) &&
-         !(conn->flags & NSF_BUFFER_BUT_DONT_SEND))) {
-      //DBG(("%p write_set", conn));
-      ns_add_to_set(conn->sock, &write_set, &max_fd);
-    }
-    if (conn->flags & NSF_CLOSE_IMMEDIATELY) {
-      ns_close_conn(conn);
-    }
+// Try the next server, or give up
+static void ns_dns_retry(struct ns_mgr *mgr, struct ns_dns_query *q) {
+  if (q->attempts >= NS_DNS_MAX_ATTEMPTS || ns_dns_send(mgr, q) != 0) {
+    DBG(("%s: no reply", q->name));
+    ns_dns_complete(mgr, q, -1, NULL, 0);
   }
+}
 
-  tv.tv_sec = milli / 1000;
-  tv.tv_usec = (milli % 1000) * 1000;
+static void ns_dns_handler(struct ns_connection *nc, int ev, void *p) {
+  struct ns_dns_query *q = (struct ns_dns_query *) nc->user_data;
+  struct iobuf *io = &nc->recv_iobuf;
+  union socket_address sa;
+  uint32_t ttl;
+  int res;
 
-  if (select((int) max_fd + 1, &read_set, &write_set, NULL, &tv) > 0) {
-    // select() might have been waiting for a long time, reset current_time
-    // now to prevent last_io_time being set to the past.
-    current_time = time(NULL);
+  (void) p;
+  if (q == NULL) return;  // Query is done, socket is closing
 
-    // Read wakeup messages
-    if (mgr->ctl[1] != INVALID_SOCKET &&
-        FD_ISSET(mgr->ctl[1], &read_set)) {
-      struct ctl_msg ctl_msg;
-      int len = (int) recv(mgr->ctl[1], (char *) &ctl_msg, sizeof(ctl_msg), 0);
-      send(mgr->ctl[1], ctl_msg.message, 1, 0);
-      if (len >= (int) sizeof(ctl_msg.callback) && ctl_msg.callback != NULL) {
-        struct ns_connection *c;
-        for (c = ns_next(mgr, NULL); c != NULL; c = ns_next(mgr, c)) {
-          ctl_msg.callback(c, NS_POLL, ctl_msg.message);
-        }
-      }
-    }
+  switch (ev) {
+    case NS_RECV:
+      // Each datagram is delivered separately. Replies that don't match
+      // the query are dropped, the query keeps waiting.
+      memset(&sa, 0, sizeof(sa));
+      res = ns_dns_parse_reply((unsigned char *) io->buf, (int) io->len, q,
+                               &sa, &ttl);
+      iobuf_remove(io, io->len);
+      if (res >= 0) ns_dns_complete(nc->mgr, q, res, &sa, ttl);
+      break;
+    case NS_TIMER:
+      ns_dns_retry(nc->mgr, q);
+      break;
+    case NS_CLOSE:
+      // Socket error, e.g. the server port is unreachable
+      q->nc = NULL;
+      ns_dns_retry(nc->mgr, q);
+      break;
+    default:
+      break;
+  }
+}
 
-    for (conn = mgr->active_connections; conn != NULL; conn = tmp_conn) {
-      tmp_conn = conn->next;
-      if (FD_ISSET(conn->sock, &read_set)) {
-        if (conn->flags & NSF_LISTENING) {
-          if (conn->flags & NSF_UDP) {
-            ns_handle_udp(conn);
-          } else {
-            // We're not looping here, and accepting just one connection at
-            // a time. The reason is that eCos does not respect non-blocking
-            // flag on a listening socket and hangs in a loop.
-            accept_conn(conn);
-          }
-        } else {
-          conn->last_io_time = current_time;
-          ns_read_from_socket(conn);
-        }
-      }
+static int ns_dns_start(struct ns_mgr *mgr, const char *name, int qtype,
+                        ns_resolve_cb_t cb, void *user_data,
+                        struct ns_connection *conn) {
+  struct ns_dns *dns;
+  struct ns_dns_query *q, *tmp;
+  unsigned char buf[NS_DNS_MAX_QUERY_SIZE];
+
+  // A name that can't be put in a query fails now, not after the retries
+  if (strlen(name) >= sizeof(q->name) ||
+      ns_dns_encode_query(buf, sizeof(buf), 0, name, qtype) <= 0 ||
+      (dns = ns_dns_get(mgr)) == NULL) {
+    return -1;
+  }
+  if ((q = (struct ns_dns_query *) NS_MALLOC(sizeof(*q))) == NULL) return -1;
 
-      if (FD_ISSET(conn->sock, &write_set)) {
-        if (conn->flags & NSF_CONNECTING) {
-          ns_read_from_socket(conn);
-        } else if (!(conn->flags & NSF_BUFFER_BUT_DONT_SEND)) {
-          conn->last_io_time = current_time;
-          ns_write_to_socket(conn);
-        }
-      }
-    }
+  memset(q, 0, sizeof(*q));
+  if (ns_random(mgr, &q->id, sizeof(q->id)) != 0) {
+    NS_FREE(q);
+    return -1;
   }
+  q->qtype = qtype;
+  q->cb = cb;
+  q->user_data = user_data;
+  if (conn != NULL) {
+    q->has_conn = 1;
+    q->conn = ns_handle(conn);
+  }
+  strcpy(q->name, name);
 
-  for (conn = mgr->active_connections; conn != NULL; conn = tmp_conn) {
-    tmp_conn = conn->next;
-    if ((conn->flags & NSF_CLOSE_IMMEDIATELY) ||
-        (conn->send_iobuf.len == 0 &&
-          (conn->flags & NSF_FINISHED_SENDING_DATA))) {
-      ns_close_conn(conn);
+  // Many connections to one host make a single query
+  for (tmp = dns->queries; tmp != NULL; tmp = tmp->next) {
+    if (!tmp->waiting && tmp->qtype == qtype &&
+        ns_dns_name_eq(tmp->name, name)) {
+      q->waiting = 1;
+      break;
     }
   }
+  q->next = dns->queries;
+  dns->queries = q;
+  if (cb != NULL || conn != NULL) {
+    dns->stats.misses++;  // Not a refresh of a stale entry
+  }
+  if (!q->waiting && ns_dns_send(mgr, q) != 0) {
+    ns_dns_unlink(dns, q);
+    NS_FREE(q);
+    return -1;
+  }
 
-  return current_time;
+  return 0;
+}
+
+// Resolve "name" without blocking. The callback is called from
+// ns_mgr_poll(), or right away if the name is in the hosts file or cache.
+int ns_resolve_async(struct ns_mgr *mgr, const char *name, int qtype,
+                     ns_resolve_cb_t cb, void *user_data) {
+  union socket_address sa;
+  int res = 0;
+
+  memset(&sa, 0, sizeof(sa));
+  if (ns_dns_lookup_hosts(mgr, name, qtype, &sa) ||
+      (res = ns_dns_lookup_cache(mgr, name, qtype, &sa)) > 0) {
+    cb(mgr, name, &sa, user_data);
+    return 0;
+  } else if (res < 0) {
+    cb(mgr, name, NULL, user_data);
+    return 0;
+  }
+  return ns_dns_start(mgr, name, qtype, cb, user_data, NULL);
+}
+
+void ns_mgr_dns_stats(struct ns_mgr *mgr, struct ns_dns_stats *stats) {
+  if (mgr->dns != NULL) {
+    *stats = mgr->dns->stats;
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+// Fail lookups still in flight, then free the resolver. Runs before the
+// manager closes its connections, so closing query sockets starts no retries.
+static void ns_dns_free(struct ns_mgr *mgr) {
+  struct ns_dns_query *q;
+
+  if (mgr->dns == NULL) return;
+  while ((q = mgr->dns->queries) != NULL) {
+    mgr->dns->queries = q->next;
+    ns_dns_finish(mgr, q, NULL);
+  }
+  ns_dns_cache_free(mgr->dns);
+  ns_dns_free_hosts(mgr->dns);
+  NS_FREE(mgr->dns);
+  mgr->dns = NULL;
 }
 
 struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
@@ -832,15 +3203,24 @@ struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
   sock_t sock = INVALID_SOCKET;
   struct ns_connection *nc = NULL;
   union socket_address sa;
-  char cert[100], ca_cert[100];
-  int rc, use_ssl, proto;
-
-  ns_parse_address(address, &sa, &proto, &use_ssl, cert, ca_cert);
+  char cert[100], ca_cert[100], host[200];
+  int rc = 0, use_ssl, proto, resolving;
+
+  ns_parse_address(address, &sa, &proto, &use_ssl, cert, ca_cert, host);
+  // Names from the hosts file or DNS cache are known right away
+  resolving = host[0] != '\0' &&
+    !ns_dns_lookup_hosts(mgr, host, NS_DNS_A, &sa);
+  if (resolving && (rc = ns_dns_lookup_cache(mgr, host, NS_DNS_A, &sa)) != 0) {
+    if (rc < 0) return NULL;  // Name does not exist
+    resolving = rc = 0;
+  }
   if ((sock = socket(AF_INET, proto, 0)) == INVALID_SOCKET) {
     return NULL;
   }
   ns_set_non_blocking_mode(sock);
-  rc = (proto == SOCK_DGRAM) ? 0 : connect(sock, &sa.sa, sizeof(sa.sin));
+  if (proto == SOCK_STREAM && !resolving) {
+    rc = connect(sock, &sa.sa, sizeof(sa.sin));
+  }
 
   if (rc != 0 && ns_is_error(rc)) {
     closesocket(sock);
@@ -852,17 +3232,25 @@ struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
 
   nc->sa = sa;   // Important, cause UDP conns will use sendto()
   nc->flags = (proto == SOCK_DGRAM) ? NSF_UDP : NSF_CONNECTING;
+  if (resolving) {
+    // connect() is called by ns_dns_connect_done()
+    nc->flags |= NSF_RESOLVING;
+    if (ns_dns_start(mgr, host, NS_DNS_A, NULL, NULL, nc) != 0) {
+      ns_close_conn(nc);
+      return NULL;
+    }
+  }
 
 #ifdef NS_ENABLE_SSL
   if (use_ssl) {
-    if ((nc->ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL ||
-        ns_use_cert(nc->ssl_ctx, cert) != 0 ||
-        ns_use_ca_cert(nc->ssl_ctx, ca_cert) != 0 ||
-        (nc->ssl = SSL_new(nc->ssl_ctx)) == NULL) {
+    struct ns_client_ssl_ctx *cc = ns_get_client_ssl_ctx(mgr, cert, ca_cert);
+    if (cc == NULL || (nc->ssl = SSL_new(cc->ctx)) == NULL) {
       ns_close_conn(nc);
       return NULL;
     } else {
       SSL_set_fd(nc->ssl, sock);
+      SSL_set_app_data(nc->ssl, nc);
+      if (!resolving) ns_resume_client_ssl_session(nc);
     }
   }
 #endif
@@ -870,44 +3258,332 @@ struct ns_connection *ns_connect(struct ns_mgr *mgr, const char *address,
   return nc;
 }
 
-struct ns_connection *ns_add_sock(struct ns_mgr *s, sock_t sock,
-                                  ns_callback_t callback, void *user_data) {
+// set_flags is zero for sockets that are already non-blocking and
+// close-on-exec, like the ones from accept4()
+static struct ns_connection *ns_add_sock2(struct ns_mgr *s, sock_t sock,
+                                          ns_callback_t callback,
+                                          void *user_data, int set_flags) {
   struct ns_connection *conn;
-  if ((conn = (struct ns_connection *) NS_MALLOC(sizeof(*conn))) != NULL) {
-    memset(conn, 0, sizeof(*conn));
-    ns_set_non_blocking_mode(sock);
-    ns_set_close_on_exec(sock);
+  if ((conn = ns_alloc_conn(s)) != NULL) {
+    conn->recv_iobuf.pool = conn->send_iobuf.pool = &s->buf_pool;
+    if (set_flags) {
+      ns_set_non_blocking_mode(sock);
+      ns_set_close_on_exec(sock);
+    }
     conn->sock = sock;
     conn->user_data = user_data;
     conn->callback = callback;
     conn->mgr = s;
-    conn->last_io_time = time(NULL);
+    conn->last_io_time = s->now;
+    conn->last_io_ms = s->now_ms;
     ns_add_conn(s, conn);
     DBG(("%p %d", conn, sock));
   }
   return conn;
 }
 
+struct ns_connection *ns_add_sock(struct ns_mgr *s, sock_t sock,
+                                  ns_callback_t callback, void *user_data) {
+  return ns_add_sock2(s, sock, callback, user_data, 1);
+}
+
 struct ns_connection *ns_next(struct ns_mgr *s, struct ns_connection *conn) {
   return conn == NULL ? s->active_connections : conn->next;
 }
 
-void ns_broadcast(struct ns_mgr *mgr, ns_callback_t cb,void *data, size_t len) {
-  struct ctl_msg ctl_msg;
-  if (mgr->ctl[0] != INVALID_SOCKET && data != NULL &&
-      len < sizeof(ctl_msg.message)) {
-    ctl_msg.callback = cb;
-    memcpy(ctl_msg.message, data, len);
-    send(mgr->ctl[0], (char *) &ctl_msg,
-         offsetof(struct ctl_msg, message) + len, 0);
-    recv(mgr->ctl[0], (char *) &len, 1, 0);
+struct ns_connection *ns_conn_by_id(struct ns_mgr *mgr, unsigned int id) {
+  struct ns_connection *c;
+
+  if (id >= mgr->num_conn_slabs * NS_CONN_SLAB_SIZE) return NULL;
+  c = &mgr->conn_slabs[id / NS_CONN_SLAB_SIZE]->conns[id % NS_CONN_SLAB_SIZE];
+
+  return c->flags & NSF_UNUSED ? NULL : c;
+}
+
+struct ns_handle ns_handle(struct ns_connection *nc) {
+  struct ns_handle h;
+  h.id = nc->id;
+  h.gen = nc->gen;
+  return h;
+}
+
+// Return the connection h refers to, or NULL if it has been closed.
+// Must be called from the event loop thread.
+struct ns_connection *ns_handle_conn(struct ns_mgr *mgr,
+                                     struct ns_handle h) {
+  struct ns_connection *c = ns_conn_by_id(mgr, h.id);
+  return c != NULL && c->gen == h.gen ? c : NULL;
+}
+
+void ns_mgr_mem_report(struct ns_mgr *mgr, struct ns_mem_report *r) {
+  struct ns_connection *c;
+  int i;
+
+  memset(r, 0, sizeof(*r));
+  r->conn_bytes = mgr->num_conn_slabs * sizeof(struct ns_conn_slab);
+  for (i = 0; i < NS_BUF_POOL_CLASSES; i++) {
+    r->pool_free_bytes += mgr->buf_pool.classes[i].num_free *
+      mgr->buf_pool.classes[i].size;
+  }
+  for (c = mgr->free_conns; c != NULL; c = c->next) {
+    r->num_free_conns++;
+  }
+  for (c = mgr->active_connections; c != NULL; c = c->next) {
+    r->num_conns++;
+    r->recv_buf_bytes += c->recv_iobuf.size;
+    r->send_buf_bytes += c->send_iobuf.size;
+#ifdef NS_ENABLE_SSL
+    if (c->ssl != NULL) {
+      r->num_ssl++;
+    } else if (c->ssl_ctx != NULL && !(c->flags & NSF_LISTENING)) {
+      r->num_ssl_deferred++;
+    }
+#endif
+  }
+}
+
+// Run cb(nc, NS_POLL, data) on every connection from the event loop thread
+// and wait until that is done. data is not copied, so len is unused; NULL
+// data is ignored, as it always was. Without threads the caller is the event
+// loop thread itself, so queued messages are run right away.
+void ns_broadcast(struct ns_mgr *mgr, ns_callback_t cb, void *data,
+                  size_t len) {
+  struct ns_ctl_msg msg;
+
+  (void) len;
+  if (data == NULL) return;
+  memset(&msg, 0, sizeof(msg));
+  msg.callback = cb;
+  msg.data = data;
+  ns_ctl_push(mgr, &msg);
+
+#ifdef NS_DISABLE_THREADS
+  ns_ctl_run(mgr);
+#endif
+  ns_mutex_lock(&mgr->ctl_lock);
+  while (!msg.done) {
+    ns_cond_wait(&mgr->ctl_done, &mgr->ctl_lock);
+  }
+  ns_mutex_unlock(&mgr->ctl_lock);
+}
+
+static struct ns_ctl_msg *ns_new_ctl_msg(ns_callback_t cb, const void *data,
+                                         size_t len) {
+  struct ns_ctl_msg *msg;
+
+  if ((msg = (struct ns_ctl_msg *) NS_MALLOC(sizeof(*msg) + len)) != NULL) {
+    memset(msg, 0, sizeof(*msg));
+    msg->callback = cb;
+    msg->data = msg + 1;
+    msg->is_async = 1;
+    if (len > 0) memcpy(msg->data, data, len);
+  }
+
+  return msg;
+}
+
+int ns_broadcast_async(struct ns_mgr *mgr, ns_callback_t cb, const void *data,
+                       size_t len) {
+  struct ns_ctl_msg *msg;
+
+  if ((msg = ns_new_ctl_msg(cb, data, len)) == NULL) return -1;
+  ns_ctl_push(mgr, msg);
+
+  return 0;
+}
+
+// Run cb(nc, NS_POLL, data_copy) on the connection h refers to, from the
+// event loop thread. Nothing is called if the connection closes before that.
+// Safe to call from any thread.
+int ns_post(struct ns_mgr *mgr, struct ns_handle h, ns_callback_t cb,
+            const void *data, size_t len) {
+  struct ns_ctl_msg *msg;
+
+  if ((msg = ns_new_ctl_msg(cb, data, len)) == NULL) return -1;
+  msg->is_targeted = 1;
+  msg->target = h;
+  ns_ctl_push(mgr, msg);
+
+  return 0;
+}
+
+// Worker pool for blocking handler work. A job carries a copy of the
+// caller's data in a ctl message, and the worker posts that message back to
+// the connection when done, so completion goes through the lock-free queue.
+struct ns_job {
+  struct ns_job *next;
+  ns_job_fn_t fn;
+  struct ns_ctl_msg *msg;           // Completion, targets the connection
+};
+
+struct ns_workers {
+  ns_mutex_t lock;
+  ns_cond_t cond;
+  struct ns_mgr *mgr;
+  struct ns_job *pending;           // Jobs for workers to pick up
+  struct ns_job **pending_tail;
+  int stopping;
+  struct ns_job_stats stats;
+};
+
+static void ns_job_done(struct ns_connection *nc, int ev, void *job_data) {
+  (void) ev;
+  ns_call(nc, NS_JOB_DONE, job_data);
+}
+
+#ifndef NS_DISABLE_THREADS
+static void *ns_worker(void *param) {
+  struct ns_workers *w = (struct ns_workers *) param;
+  struct ns_job *job;
+
+  ns_mutex_lock(&w->lock);
+  while (!w->stopping) {
+    if ((job = w->pending) == NULL) {
+      ns_cond_wait(&w->cond, &w->lock);
+      continue;
+    }
+    if ((w->pending = job->next) == NULL) w->pending_tail = &w->pending;
+    w->stats.num_queued--;
+    w->stats.num_running++;
+    ns_mutex_unlock(&w->lock);
+
+    job->fn(job->msg->data);
+
+    // Count the job as done before the loop can see its result
+    ns_mutex_lock(&w->lock);
+    w->stats.num_running--;
+    w->stats.num_completed++;
+    ns_ctl_push(w->mgr, job->msg);
+    NS_FREE(job);
+  }
+  w->stats.num_threads--;
+  ns_cond_broadcast(&w->cond);
+  ns_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+#endif
+
+int ns_mgr_start_workers(struct ns_mgr *mgr, int num_threads, int max_queued) {
+#ifdef NS_DISABLE_THREADS
+  (void) mgr;
+  (void) num_threads;
+  (void) max_queued;
+  return -1;
+#else
+  struct ns_workers *w;
+  int i;
+
+  if (mgr->workers != NULL || num_threads <= 0 || max_queued <= 0 ||
+      (w = (struct ns_workers *) NS_MALLOC(sizeof(*w))) == NULL) {
+    return -1;
+  }
+  memset(w, 0, sizeof(*w));
+  w->mgr = mgr;
+  w->pending_tail = &w->pending;
+  w->stats.max_queued = max_queued;
+  ns_mutex_init(&w->lock);
+  ns_cond_init(&w->cond);
+  mgr->workers = w;
+
+  ns_mutex_lock(&w->lock);
+  for (i = 0; i < num_threads; i++) {
+    if (ns_start_thread(ns_worker, w) != NULL) w->stats.num_threads++;
+  }
+  ns_mutex_unlock(&w->lock);
+
+  return w->stats.num_threads > 0 ? 0 : -1;
+#endif
+}
+
+// Run fn on a worker thread with a copy of job_data. When it returns, the
+// connection gets NS_JOB_DONE with the same copy, which may hold results.
+// The copy is freed after that, or dropped if the connection has closed.
+// Return -1 if there are no workers or the queue is full.
+int ns_submit_job(struct ns_connection *nc, ns_job_fn_t fn,
+                  const void *job_data, size_t len) {
+  struct ns_workers *w = nc->mgr->workers;
+  struct ns_job *job;
+  int ok;
+
+  if (w == NULL || w->stats.num_threads == 0) return -1;
+
+  ns_mutex_lock(&w->lock);
+  ok = w->stats.num_queued < w->stats.max_queued;
+  if (!ok) w->stats.num_rejected++;
+  ns_mutex_unlock(&w->lock);
+  if (!ok) return -1;
+
+  if ((job = (struct ns_job *) NS_MALLOC(sizeof(*job))) == NULL) return -1;
+  if ((job->msg = ns_new_ctl_msg(ns_job_done, job_data, len)) == NULL) {
+    NS_FREE(job);
+    return -1;
+  }
+  job->msg->is_targeted = 1;
+  job->msg->target = ns_handle(nc);
+  job->fn = fn;
+  job->next = NULL;
+
+  ns_mutex_lock(&w->lock);
+  *w->pending_tail = job;
+  w->pending_tail = &job->next;
+  w->stats.num_submitted++;
+  if (++w->stats.num_queued > w->stats.peak_queued) {
+    w->stats.peak_queued = w->stats.num_queued;
+  }
+  ns_cond_signal(&w->cond);
+  ns_mutex_unlock(&w->lock);
+
+  return 0;
+}
+
+void ns_mgr_job_stats(struct ns_mgr *mgr, struct ns_job_stats *stats) {
+  struct ns_workers *w = mgr->workers;
+
+  memset(stats, 0, sizeof(*stats));
+  if (w != NULL) {
+    ns_mutex_lock(&w->lock);
+    *stats = w->stats;
+    ns_mutex_unlock(&w->lock);
+  }
+}
+
+// Wait for running jobs, drop those not started yet
+static void ns_stop_workers(struct ns_mgr *mgr) {
+  struct ns_workers *w = mgr->workers;
+  struct ns_job *job, *tmp;
+
+  if (w == NULL) return;
+  ns_mutex_lock(&w->lock);
+  w->stopping = 1;
+  ns_cond_broadcast(&w->cond);
+  while (w->stats.num_threads > 0) {
+    ns_cond_wait(&w->cond, &w->lock);
+  }
+  ns_mutex_unlock(&w->lock);
+
+  for (job = w->pending; job != NULL; job = tmp) {
+    tmp = job->next;
+    NS_FREE(job->msg);
+    NS_FREE(job);
   }
+  ns_cond_destroy(&w->cond);
+  ns_mutex_destroy(&w->lock);
+  NS_FREE(w);
+  mgr->workers = NULL;
 }
 
 void ns_mgr_init(struct ns_mgr *s, void *user_data) {
   memset(s, 0, sizeof(*s));
   s->ctl[0] = s->ctl[1] = INVALID_SOCKET;
+  s->accept_budget = NS_ACCEPT_BUDGET;
+  ns_update_time(s);
+  s->ctl_head = s->ctl_tail = &s->ctl_stub;
+  ns_mutex_init(&s->ctl_lock);
+  ns_cond_init(&s->ctl_done);
   s->user_data = user_data;
+  s->rnd_pos = sizeof(s->rnd_pool);
+  ns_buf_pool_init(&s->buf_pool);
 
 #ifdef _WIN32
   { WSADATA data; WSAStartup(MAKEWORD(2, 2), &data); }
@@ -917,10 +3593,13 @@ void ns_mgr_init(struct ns_mgr *s, void *user_data) {
   signal(SIGPIPE, SIG_IGN);
 #endif
 
-#ifndef NS_DISABLE_SOCKETPAIR
+#if defined(NS_ENABLE_EVENTFD)
+  s->ctl[0] = s->ctl[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(NS_DISABLE_SOCKETPAIR)
   do {
     ns_socketpair2(s->ctl, SOCK_DGRAM);
   } while (s->ctl[0] == INVALID_SOCKET);
+  ns_set_non_blocking_mode(s->ctl[1]);
 #endif
 
 #ifdef NS_ENABLE_SSL
@@ -936,19 +3615,44 @@ void ns_mgr_free(struct ns_mgr *s) {
   // Do one last poll, see https://github.com/cesanta/mongoose/issues/286
   ns_mgr_poll(s, 0);
 
+  // Workers post completions to ctl, stop them first
+  ns_stop_workers(s);
   if (s->ctl[0] != INVALID_SOCKET) closesocket(s->ctl[0]);
-  if (s->ctl[1] != INVALID_SOCKET) closesocket(s->ctl[1]);
+  if (s->ctl[1] != INVALID_SOCKET && s->ctl[1] != s->ctl[0]) {
+    closesocket(s->ctl[1]);
+  }
   s->ctl[0] = s->ctl[1] = INVALID_SOCKET;
 
+#ifdef NS_ENABLE_SSL
+  ns_stop_ssl_workers(s);
+#endif
+
+  // Deliver messages that raced with the last poll
+  ns_ctl_run(s);
+
+  ns_dns_free(s);
   for (conn = s->active_connections; conn != NULL; conn = tmp_conn) {
     tmp_conn = conn->next;
     ns_close_conn(conn);
   }
+  ns_mutex_destroy(&s->ctl_lock);
+  ns_cond_destroy(&s->ctl_done);
+
+#ifdef NS_ENABLE_SSL
+  ns_free_client_ssl_ctxs(s);
+#endif
+  ns_free_conn_slabs(s);
+  NS_FREE(s->udp_buf);
+  ns_buf_pool_free(&s->buf_pool);
 }
 // Copyright (c) 2014 Cesanta Software Limited
 // All rights reserved
 
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Check whether full request is buffered. Return:
 //   -1  if request is malformed
 //    0  if request is not yet fully buffered
@@ -971,6 +3675,22 @@ static int get_request_len(const char *s, int buf_len) {
   return 0;
 }
 
+// Replies with these codes never have a body, RFC 7230 section 3.3.3.
+// In a reply, the protocol is parsed into "method" and the code into "uri".
+static int http_reply_without_body(const struct http_message *hm) {
+  const char *code = hm->uri.p;
+  return hm->method.len > 5 && memcmp(hm->method.p, "HTTP/", 5) == 0 &&
+    hm->uri.len == 3 && (code[0] == '1' || memcmp(code, "204", 3) == 0 ||
+                         memcmp(code, "304", 3) == 0);
+}
+
+// 1xx replies other than 101 Switching Protocols precede the final reply
+// to the same request, RFC 7231 section 6.2
+static int http_reply_is_interim(const struct http_message *hm) {
+  return http_reply_without_body(hm) && hm->uri.p[0] == '1' &&
+    memcmp(hm->uri.p, "101", 3) != 0;
+}
+
 static int parse_http(const char *s, int n, struct http_message *req) {
   const char *end;
   int len, i;
@@ -1013,7 +3733,10 @@ static int parse_http(const char *s, int n, struct http_message *req) {
     }
   }
 
-  if (req->body.len == (size_t) ~0 && ns_vcasecmp(&req->method, "GET") == 0) {
+  if (http_reply_without_body(req) ||
+      (req->body.len == (size_t) ~0 &&
+       (ns_vcasecmp(&req->method, "GET") == 0 ||
+        ns_vcasecmp(&req->method, "HEAD") == 0))) {
     req->body.len = 0;
     req->message.len = len;
   }
@@ -1029,13 +3752,49 @@ struct ns_str *get_http_header(struct http_message *hm, const char *name) {
     if (h->p != NULL && h->len == len && !ns_ncasecmp(h->p, name, len)) return v;
   }
 
-  return NULL;
+  return NULL;
+}
+
+// XOR data with the 4-byte websocket mask. Works in place (dst == src).
+// Data is processed a vector or a word at a time; as the chunk sizes are
+// multiples of 4, the mask stays aligned with the data.
+static void ns_mask_ws_data(unsigned char *dst, const unsigned char *src,
+                            size_t len, const unsigned char mask[4]) {
+  uint64_t m8, w;
+  size_t i = 0;
+
+  memcpy(&m8, mask, 4);
+  memcpy((unsigned char *) &m8 + 4, mask, 4);
+
+#ifdef __SSE2__
+  {
+    __m128i m16 = _mm_set1_epi64x((long long) m8);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(v, m16));
+    }
+  }
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, src + i, 8);
+    w ^= m8;
+    memcpy(dst + i, &w, 8);
+  }
+  for (; i < len; i++) {
+    dst[i] = src[i] ^ mask[i % 4];
+  }
+}
+
+static int is_ws_control_frame(unsigned flags) {
+  return (flags & 0x0f) == WEBSOCKET_OP_PING ||
+    (flags & 0x0f) == WEBSOCKET_OP_PONG;
 }
 
 static int deliver_websocket_data(struct ns_connection *nc) {
   // Having buf unsigned char * is important, as it is used below in arithmetic
   unsigned char *buf = (unsigned char *) nc->recv_iobuf.buf;
-  uint64_t i, data_len = 0, frame_len = 0, buf_len = nc->recv_iobuf.len,
+  uint64_t data_len = 0, frame_len = 0, buf_len = nc->recv_iobuf.len,
   len, mask_len = 0, header_len = 0, ok;
 
   if (buf_len >= 2) {
@@ -1066,13 +3825,21 @@ static int deliver_websocket_data(struct ns_connection *nc) {
 
     // Apply mask if necessary
     if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        buf[i + header_len] ^= (buf + header_len - mask_len)[i % 4];
-      }
+      ns_mask_ws_data(wsm.data, wsm.data, wsm.size, wsm.data - mask_len);
+    }
+
+    // Any frame from the peer proves it is alive
+    nc->ws_missed_pongs = 0;
+
+    // Answer pings automatically. Ping and pong frames are delivered to the
+    // event handler as control frames, not mixed with the data frames.
+    if ((wsm.flags & 0x0f) == WEBSOCKET_OP_PING) {
+      ns_send_websocket(nc, WEBSOCKET_OP_PONG, wsm.data, wsm.size);
     }
 
     // Call event handler
-    ((ns_callback_t) nc->proto_data)(nc, NS_WEBSOCKET_FRAME, &wsm);
+    ((ns_callback_t) nc->proto_data)(nc, is_ws_control_frame(wsm.flags) ?
+      NS_WEBSOCKET_CONTROL_FRAME : NS_WEBSOCKET_FRAME, &wsm);
 
     // Remove frame from the iobuf
     iobuf_remove(&nc->recv_iobuf, frame_len);
@@ -1081,15 +3848,24 @@ static int deliver_websocket_data(struct ns_connection *nc) {
   return ok;
 }
 
-static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len) {
+// Largest websocket frame header: 2 bytes, 8 bytes of extended length
+// and 4 bytes of mask
+#define NS_WS_MAX_HEADER_SIZE 14
+
+// Payload space initially reserved by ns_printf_websocket()
+#define NS_WS_PRINTF_RESERVE 256
+
+// Encode websocket frame header into the buffer, return header length.
+// If mask is not NULL, mark the frame as masked and append the mask.
+static int ns_encode_ws_header(unsigned char *header, int op, size_t len,
+                               const unsigned char *mask) {
   int header_len;
-  unsigned char header[10];
 
   header[0] = 0x80 + (op & 0x0f);
   if (len < 126) {
     header[1] = len;
     header_len = 2;
-  } else if (len < 65535) {
+  } else if (len < 65536) {
     header[1] = 126;
     * (uint16_t *) &header[2] = htons((uint16_t) len);
     header_len = 4;
@@ -1099,33 +3875,138 @@ static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len) {
     * (uint32_t *) &header[6] = htonl((uint32_t) (len & 0xffffffff));
     header_len = 10;
   }
-  ns_send(nc, header, header_len);
+
+  if (mask != NULL) {
+    header[1] |= 0x80;
+    memcpy(header + header_len, mask, 4);
+    header_len += 4;
+  }
+
+  return header_len;
 }
 
-void ns_send_websocket(struct ns_connection *nc, int op,
-                       const void *data, size_t len) {
-  ns_send_ws_header(nc, op, len);
-  ns_send(nc, data, len);
+// Frames sent by the client must be masked, RFC 6455 section 5.3. Set
+// *mask to the mask to use, or NULL for the server side. Return -1 and
+// close the connection if no unpredictable mask can be made.
+static int ns_ws_mask(struct ns_connection *nc, unsigned char buf[4],
+                      unsigned char **mask) {
+  *mask = NULL;
+  if (nc->listener != NULL) return 0;
+  if (ns_random(nc->mgr, buf, 4) != 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return -1;
+  }
+  *mask = buf;
+  return 0;
+}
+
+// Make sure that n more bytes can be appended to the iobuf without
+// reallocation. Unlike iobuf_resize(), never shrinks the buffer.
+static int ns_ws_reserve(struct iobuf *io, size_t n) {
+  if (io->len + n > io->size) {
+    iobuf_resize(io, io->len + n);
+  }
+  return io->len + n <= io->size;
+}
 
+static void ns_ws_frame_queued(struct ns_connection *nc, int op) {
   if (op == WEBSOCKET_OP_CLOSE) {
     nc->flags |= NSF_FINISHED_SENDING_DATA;
   }
 }
 
+void ns_send_websocket(struct ns_connection *nc, int op,
+                       const void *data, size_t len) {
+  struct iobuf *io = &nc->send_iobuf;
+  unsigned char header[NS_WS_MAX_HEADER_SIZE], mask_buf[4], *mask, *p;
+  int header_len;
+
+  if (ns_ws_mask(nc, mask_buf, &mask) != 0) return;
+  header_len = ns_encode_ws_header(header, op, len, mask);
+
+  // Append the whole frame at once, growing the send buffer at most once.
+  // Client frames are masked while being copied.
+  if (ns_ws_reserve(io, header_len + len)) {
+    p = (unsigned char *) io->buf + io->len;
+    memcpy(p, header, header_len);
+    if (len > 0 && mask != NULL) {
+      ns_mask_ws_data(p + header_len, (const unsigned char *) data, len, mask);
+    } else if (len > 0) {
+      memcpy(p + header_len, data, len);
+    }
+    io->len += header_len + len;
+    ns_check_watermarks(nc);
+  }
+
+  ns_ws_frame_queued(nc, op);
+}
+
 void ns_printf_websocket(struct ns_connection *nc, int op,
                          const char *fmt, ...) {
-  char mem[4192], *buf = mem;
+  struct iobuf *io = &nc->send_iobuf;
+  unsigned char header[NS_WS_MAX_HEADER_SIZE], mask_buf[4], *mask, *p;
+  size_t avail = NS_WS_PRINTF_RESERVE;
+  int short_len, header_len, len = -1;
   va_list ap;
-  int len;
 
-  va_start(ap, fmt);
-  if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
-    ns_send_websocket(nc, op, buf, len);
+  if (ns_ws_mask(nc, mask_buf, &mask) != 0) return;
+  short_len = mask == NULL ? 2 : 6;
+
+  // Format the payload straight into the send buffer, behind the room for
+  // a short header. Small frames, which are the common case, are then
+  // complete without any copying. If the payload does not fit, grow the
+  // buffer and format again.
+  while (ns_ws_reserve(io, NS_WS_MAX_HEADER_SIZE + avail)) {
+    va_start(ap, fmt);
+    len = vsnprintf(io->buf + io->len + short_len, avail, fmt, ap);
+    va_end(ap);
+    if (len >= 0 && (size_t) len < avail) break;
+    // eCos and Windows return -1 when the buffer is too small
+    avail = len < 0 ? avail * 2 : (size_t) len + 1;
+    len = -1;
   }
-  va_end(ap);
 
-  if (buf != mem && buf != NULL) {
-    free(buf);
+  if (len > 0) {
+    p = (unsigned char *) io->buf + io->len;
+    header_len = ns_encode_ws_header(header, op, len, mask);
+    if (header_len > short_len) {
+      memmove(p + header_len, p + short_len, len);
+    }
+    memcpy(p, header, header_len);
+    if (mask != NULL) {
+      ns_mask_ws_data(p + header_len, p + header_len, len, mask);
+    }
+    io->len += header_len + len;
+    ns_check_watermarks(nc);
+    ns_ws_frame_queued(nc, op);
+  }
+}
+
+// Set up websocket keepalive: ping the peer every "interval" seconds,
+// and close the connection if "max_missed_pongs" pings in a row stay
+// unanswered. Zero interval disables keepalive. When called for a
+// listening connection, settings apply to all accepted connections.
+// Keepalive uses connection's timer, see ns_set_timer().
+void ns_set_websocket_keepalive(struct ns_connection *nc, int interval,
+                                int max_missed_pongs) {
+  nc->ws_ping_interval = interval;
+  nc->ws_max_missed_pongs = max_missed_pongs;
+  nc->ws_missed_pongs = 0;
+  if (nc->flags & NSF_USER_1) {
+    ns_set_timer_ms(nc, interval > 0 ? nc->mgr->now_ms + interval * 1000 : 0);
+  }
+}
+
+static void websocket_keepalive(struct ns_connection *nc) {
+  if (nc->ws_ping_interval <= 0) {
+    // Keepalive is disabled, timer belongs to the user
+  } else if (nc->ws_missed_pongs >= nc->ws_max_missed_pongs) {
+    DBG(("%p dead peer, %d pings unanswered", nc, nc->ws_missed_pongs));
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else {
+    ns_send_websocket(nc, WEBSOCKET_OP_PING, NULL, 0);
+    nc->ws_missed_pongs++;
+    ns_set_timer_ms(nc, nc->mgr->now_ms + nc->ws_ping_interval * 1000);
   }
 }
 
@@ -1138,11 +4019,21 @@ static void websocket_handler(struct ns_connection *nc, int ev, void *ev_data) {
     case NS_RECV:
       do { } while (deliver_websocket_data(nc));
       break;
+    case NS_TIMER:
+      websocket_keepalive(nc);
+      break;
     default:
       break;
   }
 }
 
+static void ws_handshake_done(struct ns_connection *nc, ns_callback_t cb) {
+  if (nc->ws_ping_interval > 0) {
+    ns_set_timer_ms(nc, nc->mgr->now_ms + nc->ws_ping_interval * 1000);
+  }
+  cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+}
+
 static void send_websocket_handshake(struct ns_connection *nc,
                                      const struct ns_str *key) {
   static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -1168,48 +4059,60 @@ static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
   ns_callback_t cb = (ns_callback_t) nc->proto_data;
   struct http_message hm;
   struct ns_str *vec;
-  int req_len;
+  int req_len, interim;
+
+  if (ev == NS_ACCEPT) {
+    // Inherit websocket keepalive settings from the listener
+    nc->ws_ping_interval = nc->listener->ws_ping_interval;
+    nc->ws_max_missed_pongs = nc->listener->ws_max_missed_pongs;
+  }
 
   cb(nc, ev, ev_data);
 
   switch (ev) {
 
     case NS_RECV:
-      req_len = parse_http(io->buf, io->len, &hm);
-      if (req_len < 0 || io->len >= NS_MAX_HTTP_REQUEST_SIZE) {
-        nc->flags |= NSF_CLOSE_IMMEDIATELY;
-      } else if (req_len == 0) {
-        // Do nothing, request is not yet fully buffered
-      } else if (nc->listener == NULL &&
-                 get_http_header(&hm, "Sec-WebSocket-Accept")) {
-        // We're websocket client, got handshake response from server.
-        // TODO(lsm): check the validity of accept Sec-WebSocket-Accept
-        iobuf_remove(io, req_len);
-        nc->callback = websocket_handler;
-        nc->flags |= NSF_USER_1;
-        cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-        websocket_handler(nc, NS_RECV, ev_data);
-      } else if (nc->listener != NULL &&
-                 (vec = get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
-        // This is a websocket request. Switch protocol handlers.
-        iobuf_remove(io, req_len);
-        nc->callback = websocket_handler;
-        nc->flags |= NSF_USER_1;
-
-        // Send handshake
-        cb(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, NULL);
-        if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
-          if (nc->send_iobuf.len == 0) {
-            send_websocket_handshake(nc, vec);
-          }
-          cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+      // Final reply may have arrived together with interim 1xx ones
+      do {
+        interim = 0;
+        req_len = parse_http(io->buf, io->len, &hm);
+        if (req_len < 0 || io->len >= NS_MAX_HTTP_REQUEST_SIZE) {
+          nc->flags |= NSF_CLOSE_IMMEDIATELY;
+        } else if (req_len == 0) {
+          // Do nothing, request is not yet fully buffered
+        } else if (nc->listener == NULL &&
+                   get_http_header(&hm, "Sec-WebSocket-Accept")) {
+          // We're websocket client, got handshake response from server.
+          // TODO(lsm): check the validity of accept Sec-WebSocket-Accept
+          iobuf_remove(io, req_len);
+          nc->callback = websocket_handler;
+          nc->flags |= NSF_USER_1;
+          ws_handshake_done(nc, cb);
           websocket_handler(nc, NS_RECV, ev_data);
+        } else if (nc->listener != NULL &&
+                   (vec = get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
+          // This is a websocket request. Switch protocol handlers.
+          iobuf_remove(io, req_len);
+          nc->callback = websocket_handler;
+          nc->flags |= NSF_USER_1;
+
+          // Send handshake
+          cb(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, NULL);
+          if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+            if (nc->send_iobuf.len == 0) {
+              send_websocket_handshake(nc, vec);
+            }
+            ws_handshake_done(nc, cb);
+            websocket_handler(nc, NS_RECV, ev_data);
+          }
+        } else if (hm.message.len <= io->len) {
+          // Whole HTTP message is fully buffered, call event handler
+          interim = nc->listener == NULL && http_reply_is_interim(&hm);
+          if (cb) cb(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
+          iobuf_remove(io, hm.message.len);
         }
-      } else if (hm.message.len <= io->len) {
-        // Whole HTTP message is fully buffered, call event handler
-        if (cb) cb(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
-        iobuf_remove(io, hm.message.len);
-      }
+      } while (interim && io->len > 0 &&
+               !(nc->flags & NSF_CLOSE_IMMEDIATELY));
       break;
 
     case NS_CLOSE:
@@ -1246,14 +4149,15 @@ struct ns_connection *ns_connect_http(struct ns_mgr *mgr, const char *addr,
 struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
                                            ns_callback_t cb, void *udata,
                                            const char *uri, const char *hdrs) {
-  struct ns_connection *nc = ns_connect(mgr, addr, http_handler, udata);
+  struct ns_connection *nc = NULL;
+  unsigned char nonce[16];
+  char key[sizeof(nonce) * 2];
 
-  if (nc != NULL) {
-    unsigned long random = (unsigned long) uri;
-    char key[sizeof(random) * 2];
+  // The key must not be predictable, so no connection without one
+  if (ns_random(mgr, nonce, sizeof(nonce)) == 0 &&
+      (nc = ns_connect(mgr, addr, http_handler, udata)) != NULL) {
     nc->proto_data = (void *) cb;
-
-    ns_base64_encode((unsigned char *) &random, sizeof(random), key);
+    ns_base64_encode(nonce, sizeof(nonce), key);
     ns_printf(nc, "GET %s HTTP/1.1\r\n"
               "Upgrade: websocket\r\n"
               "Connection: Upgrade\r\n"
@@ -1265,6 +4169,318 @@ struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
   return nc;
 }
 
+// Pooled client connections. A pool host holds the connections opened to
+// one address, plus a FIFO of requests waiting for a free connection. The
+// address string is the key, so "ssl://" connections never mix with plain.
+struct http_pool_req {
+  struct http_pool_req *next;
+  ns_callback_t cb;
+  void *user_data;
+  int retried;
+  size_t len;
+  char buf[1];  // Request bytes, allocated together with the struct
+};
+
+struct http_pool_conn {
+  struct http_pool_conn *next;
+  struct ns_connection *nc;
+  struct http_pool_host *host;
+  struct http_pool_req *req;    // Request in flight, NULL if idle
+  int num_reqs;                 // Requests completed on this connection
+};
+
+struct http_pool_host {
+  struct http_pool_host *next;
+  struct ns_http_pool *pool;
+  char addr[100];
+  int num_conns;
+  struct http_pool_conn *conns;
+  struct http_pool_req *queue, *queue_tail;
+};
+
+struct ns_http_pool {
+  struct ns_mgr *mgr;
+  int max_conns_per_host;
+  int idle_timeout;
+  struct http_pool_host *hosts;
+};
+
+static void http_pool_handler(struct ns_connection *, int, void *);
+
+// Pass an event to the request's callback, as if the connection were its own
+static void http_pool_forward(struct ns_connection *nc,
+                              struct http_pool_req *req, int ev, void *p) {
+  void *user_data = nc->user_data;
+  nc->user_data = req->user_data;
+  req->cb(nc, ev, p);
+  nc->user_data = user_data;
+}
+
+static struct http_pool_conn *http_pool_get_conn(struct http_pool_host *host) {
+  struct ns_http_pool *pool = host->pool;
+  struct http_pool_conn *pc;
+
+  for (pc = host->conns; pc != NULL; pc = pc->next) {
+    unsigned int closing = NSF_CLOSE_IMMEDIATELY | NSF_FINISHED_SENDING_DATA;
+    if (pc->req == NULL && !(pc->nc->flags & closing)) return pc;
+  }
+
+  if (host->num_conns >= pool->max_conns_per_host ||
+      (pc = (struct http_pool_conn *) NS_MALLOC(sizeof(*pc))) == NULL) {
+    return NULL;
+  }
+  memset(pc, 0, sizeof(*pc));
+  if ((pc->nc = ns_connect_http(pool->mgr, host->addr, http_pool_handler,
+                                pc)) == NULL) {
+    NS_FREE(pc);
+    return NULL;
+  }
+  pc->host = host;
+  pc->next = host->conns;
+  host->conns = pc;
+  host->num_conns++;
+
+  return pc;
+}
+
+// Hand queued requests to idle connections, opening new ones up to the limit
+static void http_pool_dispatch(struct http_pool_host *host) {
+  struct http_pool_conn *pc;
+  struct http_pool_req *req;
+
+  while ((req = host->queue) != NULL && (pc = http_pool_get_conn(host))) {
+    if ((host->queue = req->next) == NULL) host->queue_tail = NULL;
+    req->next = NULL;
+    pc->req = req;
+    ns_set_timer_ms(pc->nc, 0);
+    ns_send(pc->nc, req->buf, (int) req->len);
+  }
+}
+
+static int http_pool_keep_alive(struct http_message *hm) {
+  struct ns_str *conn = get_http_header(hm, "Connection");
+
+  // In a reply, the protocol version is parsed into the method field
+  if (ns_vcmp(&hm->method, "HTTP/1.1") == 0) {
+    return conn == NULL || ns_vcasecmp(conn, "close") != 0;
+  }
+  return conn != NULL && ns_vcasecmp(conn, "keep-alive") == 0;
+}
+
+// Only these may be sent again when the connection drops without a reply:
+// the server may have acted on any other request already. RFC 7231 4.2.2.
+static int http_pool_idempotent(const struct http_pool_req *req) {
+  static const char *methods[] = {
+    "GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", NULL
+  };
+  size_t i, n;
+
+  for (i = 0; methods[i] != NULL; i++) {
+    n = strlen(methods[i]);
+    if (req->len > n && memcmp(req->buf, methods[i], n) == 0) return 1;
+  }
+  return 0;
+}
+
+static void http_pool_unlink(struct http_pool_conn *pc) {
+  struct http_pool_conn **p = &pc->host->conns;
+
+  while (*p != pc) p = &(*p)->next;
+  *p = pc->next;
+  pc->host->num_conns--;
+}
+
+static void http_pool_handler(struct ns_connection *nc, int ev, void *p) {
+  struct http_pool_conn *pc = (struct http_pool_conn *) nc->user_data;
+  struct iobuf *io = &nc->recv_iobuf;
+  struct http_pool_host *host;
+  struct http_pool_req *req;
+  struct http_message hm;
+  int len, num_reqs;
+
+  if (pc == NULL) return;  // Connection outlived its pool
+  host = pc->host;
+  req = pc->req;
+
+  switch (ev) {
+    case NS_HTTP_REPLY:
+      // Interim 1xx replies are not passed on, the request stays in flight
+      // and the connection busy until the final reply
+      if (req == NULL || http_reply_is_interim((struct http_message *) p)) {
+        break;
+      }
+      http_pool_forward(nc, req, ev, p);
+      pc->req = NULL;
+      pc->num_reqs++;
+      NS_FREE(req);
+      if (!http_pool_keep_alive((struct http_message *) p)) {
+        nc->flags |= NSF_FINISHED_SENDING_DATA;
+      } else if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+        if (host->pool->idle_timeout > 0) {
+          ns_set_timer_ms(nc, nc->mgr->now_ms +
+                          host->pool->idle_timeout * 1000);
+        }
+        http_pool_dispatch(host);
+      }
+      break;
+
+    case NS_RECV:
+      if (req == NULL) break;
+      http_pool_forward(nc, req, ev, p);
+      // Reply to HEAD ends with the headers, whatever Content-Length says.
+      // http_handler() can't know that, so finish the request here, past
+      // any interim replies before it.
+      num_reqs = pc->num_reqs;
+      if (req->len > 5 && memcmp(req->buf, "HEAD ", 5) == 0) {
+        while (pc->num_reqs == num_reqs &&
+               (len = parse_http(io->buf, io->len, &hm)) > 0) {
+          hm.message.len = len;
+          hm.body.len = 0;
+          http_pool_handler(nc, NS_HTTP_REPLY, &hm);
+          iobuf_remove(io, len);
+        }
+      }
+      break;
+
+    case NS_TIMER:
+      if (req == NULL) nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      break;
+
+    case NS_CLOSE:
+      if (req != NULL && io->len > 0 && parse_http(io->buf, io->len, &hm) > 0) {
+        // Reply delimited by the end of the connection
+        hm.body.len = io->buf + io->len - hm.body.p;
+        http_pool_forward(nc, req, NS_HTTP_REPLY, &hm);
+        NS_FREE(req);
+      } else if (req != NULL && pc->num_reqs > 0 && io->len == 0 &&
+                 !req->retried && http_pool_idempotent(req)) {
+        // Server has dropped a kept-alive connection just as we reused it.
+        // Nothing was answered, so the request goes first in line again.
+        req->retried = 1;
+        if ((req->next = host->queue) == NULL) host->queue_tail = req;
+        host->queue = req;
+      } else if (req != NULL) {
+        http_pool_forward(nc, req, ev, p);
+        NS_FREE(req);
+      }
+      io->len = 0;  // Already delivered, or not ours to deliver
+      nc->user_data = NULL;
+      http_pool_unlink(pc);
+      NS_FREE(pc);
+      http_pool_dispatch(host);
+      break;
+
+    default:
+      if (req != NULL) http_pool_forward(nc, req, ev, p);
+      break;
+  }
+}
+
+struct ns_http_pool *ns_http_pool_new(struct ns_mgr *mgr, int max_per_host,
+                                      int idle_timeout) {
+  struct ns_http_pool *pool;
+
+  if ((pool = (struct ns_http_pool *) NS_MALLOC(sizeof(*pool))) != NULL) {
+    memset(pool, 0, sizeof(*pool));
+    pool->mgr = mgr;
+    pool->max_conns_per_host = max_per_host > 0 ? max_per_host : 1;
+    pool->idle_timeout = idle_timeout;
+  }
+  return pool;
+}
+
+int ns_http_pool_request(struct ns_http_pool *pool, const char *addr,
+                         ns_callback_t cb, void *user_data,
+                         const char *fmt, ...) {
+  char mem[500], *buf = mem;
+  struct http_pool_host *host;
+  struct http_pool_req *req = NULL;
+  va_list ap;
+  int len;
+
+  for (host = pool->hosts; host != NULL; host = host->next) {
+    if (strcmp(host->addr, addr) == 0) break;
+  }
+  if (host == NULL) {
+    if (strlen(addr) >= sizeof(host->addr) ||
+        (host = (struct http_pool_host *) NS_MALLOC(sizeof(*host))) == NULL) {
+      return -1;
+    }
+    memset(host, 0, sizeof(*host));
+    strcpy(host->addr, addr);
+    host->pool = pool;
+    host->next = pool->hosts;
+    pool->hosts = host;
+  }
+
+  va_start(ap, fmt);
+  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
+  va_end(ap);
+
+  if (len >= 0 && (req = (struct http_pool_req *)
+                   NS_MALLOC(sizeof(*req) + len)) != NULL) {
+    req->next = NULL;
+    req->cb = cb;
+    req->user_data = user_data;
+    req->retried = 0;
+    req->len = len;
+    memcpy(req->buf, buf, len);
+  }
+  if (buf != mem && buf != NULL) {
+    free(buf);
+  }
+  if (req == NULL) return -1;
+
+  if (host->queue_tail != NULL) {
+    host->queue_tail->next = req;
+  } else {
+    host->queue = req;
+  }
+  host->queue_tail = req;
+  http_pool_dispatch(host);
+
+  // No connection to this host could be made, so nobody will serve it
+  if (host->num_conns == 0) {
+    struct http_pool_req *prev = NULL, *r;
+    for (r = host->queue; r != req; r = r->next) prev = r;
+    if (prev == NULL) {
+      host->queue = NULL;
+    } else {
+      prev->next = NULL;
+    }
+    host->queue_tail = prev;
+    NS_FREE(req);
+    return -1;
+  }
+
+  return 0;
+}
+
+void ns_http_pool_free(struct ns_http_pool *pool) {
+  struct http_pool_host *host, *next_host;
+  struct http_pool_conn *pc, *next_pc;
+  struct http_pool_req *req, *next_req;
+
+  if (pool == NULL) return;
+
+  for (host = pool->hosts; host != NULL; host = next_host) {
+    next_host = host->next;
+    for (pc = host->conns; pc != NULL; pc = next_pc) {
+      next_pc = pc->next;
+      pc->nc->user_data = NULL;
+      pc->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      NS_FREE(pc->req);
+      NS_FREE(pc);
+    }
+    for (req = host->queue; req != NULL; req = next_req) {
+      next_req = req->next;
+      NS_FREE(req);
+    }
+    NS_FREE(host);
+  }
+  NS_FREE(pool);
+}
+
 void ns_send_http_file(struct ns_connection *nc, const char *path,
                        ns_stat_t *st) {
   char buf[BUFSIZ];
@@ -1330,76 +4546,265 @@ void ns_serve_uri_from_fs(struct ns_connection *nc, struct ns_str *uri,
 
 #include <string.h>
 
-static int is_big_endian(void) {
-  static const int n = 1;
-  return ((char *) &n)[0] == 0;
-}
-
-#define SHA1HANDSOFF
-#if defined(__sun)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(NS_DISABLE_SHA1_SIMD)
+#define NS_SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
 #endif
 
-union char64long16 { unsigned char c[64]; uint32_t l[16]; };
-
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static uint32_t blk0(union char64long16 *block, int i) {
-  // Forrest: SHA expect BIG_ENDIAN, swap if LITTLE_ENDIAN
-  if (!is_big_endian()) {
-    block->l[i] = (rol(block->l[i], 24) & 0xFF00FF00) |
-      (rol(block->l[i], 8) & 0x00FF00FF);
-  }
-  return block->l[i];
-}
+// SHA1 words are big endian. Compilers turn this into a single load+bswap.
+#define load_be32(p) (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16) | \
+                      ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3])
 
-#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
-    ^block->l[(i+2)&15]^block->l[i&15],1))
-#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(block, i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define blk0(i) (block[i] = load_be32(buffer + (i) * 4))
+#define blk(i) (block[i&15] = rol(block[(i+13)&15]^block[(i+8)&15] \
+    ^block[(i+2)&15]^block[i&15],1))
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(i)+0x5A827999+rol(v,5);w=rol(w,30);
 #define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
 #define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
 #define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
 #define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
 
-void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]) {
-  uint32_t a, b, c, d, e;
-  union char64long16 block[1];
-
-  memcpy(block, buffer, 64);
-  a = state[0];
-  b = state[1];
-  c = state[2];
-  d = state[3];
-  e = state[4];
-  R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
-  R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
-  R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
-  R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
-  R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
-  R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
-  R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
-  R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
-  R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
-  R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
-  R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
-  R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
-  R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
-  R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
-  R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
-  R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
-  R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
-  R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
-  R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+// All 80 rounds, four per line. Message words are supplied by the round
+// macros. S(g) runs before rounds g * 4 .. g * 4 + 3 and can be used to
+// compute message words for the rounds that follow.
+#define SHA1_80_ROUNDS(R0, R1, R2, R3, R4, S) \
+  S(0); \
+  R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3); \
+  S(1); \
+  R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7); \
+  S(2); \
+  R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11); \
+  S(3); \
+  R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15); \
+  S(4); \
+  R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19); \
+  S(5); \
+  R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23); \
+  S(6); \
+  R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27); \
+  S(7); \
+  R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31); \
+  S(8); \
+  R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35); \
+  S(9); \
+  R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39); \
+  S(10); \
+  R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43); \
+  S(11); \
+  R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47); \
+  S(12); \
+  R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51); \
+  S(13); \
+  R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55); \
+  S(14); \
+  R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59); \
+  S(15); \
+  R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63); \
+  S(16); \
+  R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67); \
+  S(17); \
+  R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71); \
+  S(18); \
+  R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75); \
+  S(19); \
   R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
-  state[0] += a;
-  state[1] += b;
-  state[2] += c;
-  state[3] += d;
-  state[4] += e;
-  // Erase working structures. The order of operations is important,
-  // used to ensure that compiler doesn't optimize those out.
-  memset(block, 0, sizeof(block));
-  a = b = c = d = e = 0;
-  (void) a; (void) b; (void) c; (void) d; (void) e;
+
+#define SHA1_NO_SCHEDULE(g)
+
+// Reference implementation, runs everywhere
+static void sha1_blocks_scalar(uint32_t state[5], const unsigned char *buffer,
+                               size_t num_blocks) {
+  uint32_t a, b, c, d, e, block[16];
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    SHA1_80_ROUNDS(R0, R1, R2, R3, R4, SHA1_NO_SCHEDULE);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#ifdef NS_SHA1_X86
+static int sha1_cpu_has_ssse3(void) {
+  unsigned int a, b, c, d;
+  return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3);
+}
+
+static int sha1_cpu_has_shani(void) {
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) ||
+      !(c & bit_SSE4_1) || __get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b >> 29) & 1;  // CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29]
+}
+
+// Rounds that take message words with constants added from wk[]
+#define P1(v,w,x,y,z,i) z+=((w&(x^y))^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define P2(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define P3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+wk[i]+rol(v,5);w=rol(w,30);
+#define P4(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+
+// Compute message words for rounds (g + 4) * 4 .. (g + 4) * 4 + 3, while
+// the rounds g * 4 .. g * 4 + 3 are running. w[t + 3] depends on w[t],
+// which is computed here too: compute it with w[t] taken as zero, then mix
+// in rol(w[t], 1) separately.
+#define SHA1_SSSE3_SCHEDULE(g) if (g < 16) {                                \
+  x = _mm_xor_si128(w0, _mm_alignr_epi8(w1, w0, 8));                        \
+  x = _mm_xor_si128(x, w2);                                                 \
+  x = _mm_xor_si128(x, _mm_srli_si128(w3, 4));                              \
+  x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));            \
+  y = _mm_slli_si128(x, 12);                                                \
+  y = _mm_or_si128(_mm_slli_epi32(y, 1), _mm_srli_epi32(y, 31));            \
+  x = _mm_xor_si128(x, y);                                                  \
+  _mm_storeu_si128((__m128i *) &wk[(g + 4) * 4],                            \
+                   _mm_add_epi32(x, k[(g + 4) / 5]));                       \
+  w0 = w1; w1 = w2; w2 = w3; w3 = x;                                        \
+}
+
+// SSSE3: byte swap and message schedule are done four words at a time,
+// interleaved with the scalar rounds.
+__attribute__((target("ssse3")))
+static void sha1_blocks_ssse3(uint32_t state[5], const unsigned char *buffer,
+                              size_t num_blocks) {
+  const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                     4, 5, 6, 7, 0, 1, 2, 3);
+  const __m128i k[4] = {
+    _mm_set1_epi32(0x5A827999), _mm_set1_epi32(0x6ED9EBA1),
+    _mm_set1_epi32((int) 0x8F1BBCDC), _mm_set1_epi32((int) 0xCA62C1D6)
+  };
+  uint32_t wk[80], a, b, c, d, e;
+  __m128i w0, w1, w2, w3, x, y;
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    // w0..w3 hold the last 16 message words
+    w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) buffer), bswap);
+    w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 16)),
+                          bswap);
+    w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 32)),
+                          bswap);
+    w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 48)),
+                          bswap);
+    _mm_storeu_si128((__m128i *) &wk[0], _mm_add_epi32(w0, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[4], _mm_add_epi32(w1, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[8], _mm_add_epi32(w2, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[12], _mm_add_epi32(w3, k[0]));
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    SHA1_80_ROUNDS(P1, P1, P2, P3, P4, SHA1_SSSE3_SCHEDULE);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+// Four rounds k * 4 .. k * 4 + 3 with SHA extensions. m[k % 4] holds
+// message words for these rounds, while words for the following rounds
+// are being computed in the other three registers.
+#define SHA1_NI_QUAD(k, f) do {                                              \
+  if (k > 0) e = _mm_sha1nexte_epu32(e_prev, m[k % 4]);                      \
+  e_prev = abcd;                                                             \
+  if (k >= 3 && k <= 18)                                                     \
+    m[(k + 1) % 4] = _mm_sha1msg2_epu32(m[(k + 1) % 4], m[k % 4]);           \
+  abcd = _mm_sha1rnds4_epu32(abcd, e, f);                                    \
+  if (k >= 1 && k <= 16)                                                     \
+    m[(k + 3) % 4] = _mm_sha1msg1_epu32(m[(k + 3) % 4], m[k % 4]);           \
+  if (k >= 2 && k <= 17)                                                     \
+    m[(k + 2) % 4] = _mm_xor_si128(m[(k + 2) % 4], m[k % 4]);                \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_blocks_shani(uint32_t state[5], const unsigned char *buffer,
+                              size_t num_blocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e, e_save, e_prev, m[4];
+  int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+  e = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    abcd_save = abcd;
+    e_save = e;
+    for (i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *) (buffer + i * 16)), bswap);
+    }
+    e = _mm_add_epi32(e, m[0]);
+
+    SHA1_NI_QUAD(0, 0);  SHA1_NI_QUAD(1, 0);  SHA1_NI_QUAD(2, 0);
+    SHA1_NI_QUAD(3, 0);  SHA1_NI_QUAD(4, 0);  SHA1_NI_QUAD(5, 1);
+    SHA1_NI_QUAD(6, 1);  SHA1_NI_QUAD(7, 1);  SHA1_NI_QUAD(8, 1);
+    SHA1_NI_QUAD(9, 1);  SHA1_NI_QUAD(10, 2); SHA1_NI_QUAD(11, 2);
+    SHA1_NI_QUAD(12, 2); SHA1_NI_QUAD(13, 2); SHA1_NI_QUAD(14, 2);
+    SHA1_NI_QUAD(15, 3); SHA1_NI_QUAD(16, 3); SHA1_NI_QUAD(17, 3);
+    SHA1_NI_QUAD(18, 3); SHA1_NI_QUAD(19, 3);
+
+    e = _mm_sha1nexte_epu32(e_prev, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = (uint32_t) _mm_extract_epi32(e, 3);
+}
+#endif  // NS_SHA1_X86
+
+typedef void (*sha1_blocks_t)(uint32_t state[5], const unsigned char *,
+                              size_t num_blocks);
+
+// Available implementations, fastest first
+static const struct {
+  const char *name;
+  int (*is_supported)(void);
+  sha1_blocks_t blocks;
+} s_sha1_impls[] = {
+#ifdef NS_SHA1_X86
+  { "sha-ni", sha1_cpu_has_shani, sha1_blocks_shani },
+  { "ssse3", sha1_cpu_has_ssse3, sha1_blocks_ssse3 },
+#endif
+  { "scalar", NULL, sha1_blocks_scalar }
+};
+
+static sha1_blocks_t s_sha1_blocks = NULL;
+
+// Pick the fastest implementation the CPU supports, on first use
+static void sha1_blocks(uint32_t state[5], const unsigned char *buffer,
+                        size_t num_blocks) {
+  size_t i;
+
+  if (s_sha1_blocks == NULL) {
+    for (i = 0; i < ARRAY_SIZE(s_sha1_impls); i++) {
+      if (s_sha1_impls[i].is_supported == NULL ||
+          s_sha1_impls[i].is_supported()) {
+        s_sha1_blocks = s_sha1_impls[i].blocks;
+        break;
+      }
+    }
+  }
+  s_sha1_blocks(state, buffer, num_blocks);
+}
+
+void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]) {
+  sha1_blocks(state, buffer, 1);
 }
 
 void SHA1Init(SHA1_CTX *context) {
@@ -1421,10 +4826,9 @@ void SHA1Update(SHA1_CTX *context, const unsigned char *data, uint32_t len) {
   j = (j >> 3) & 63;
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64-j));
-    SHA1Transform(context->state, context->buffer);
-    for ( ; i + 63 < len; i += 64) {
-      SHA1Transform(context->state, &data[i]);
-    }
+    sha1_blocks(context->state, context->buffer, 1);
+    sha1_blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~63;
     j = 0;
   }
   else i = 0;
@@ -1491,29 +4895,230 @@ int ns_vcmp(const struct ns_str *str2, const char *str1) {
   return n1 == n2 ? memcmp(str1, str2->p, n2) : n1 > n2 ? 1 : -1;
 }
 
-void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  static const char *b64 =
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(NS_DISABLE_BASE64_SIMD)
+#define NS_BASE64_X86
+#include <immintrin.h>
+
+// SIMD level supported by the CPU: -1 not checked yet, 0 none, 1 SSSE3,
+// 2 AVX2
+static int s_base64_simd = -1;
+
+static int base64_simd_level(void) {
+  if (s_base64_simd < 0) {
+    __builtin_cpu_init();
+    s_base64_simd = __builtin_cpu_supports("avx2") ? 2 :
+      __builtin_cpu_supports("ssse3") ? 1 : 0;
+  }
+  return s_base64_simd;
+}
+
+// Encoding and decoding below follow Wojciech Mula's SIMD base64 algorithms,
+// http://0x80.pl/articles/index.html#base64-algorithm-new
+
+// Spread 12 bytes, 3 in each 32-bit lane, into 16 6-bit indices
+#define B64_ENC_RESHUFFLE(in, shuffle, and_si, mulhi_epu16, mullo_epi16,   \
+                          or_si, set1_epi32, set_epi8)                     \
+  or_si(mulhi_epu16(and_si(shuffle(in, set_epi8(10, 11, 9, 10, 7, 8, 6, 7, \
+          4, 5, 3, 4, 1, 2, 0, 1)), set1_epi32(0x0fc0fc00)),               \
+          set1_epi32(0x04000040)),                                         \
+        mullo_epi16(and_si(shuffle(in, set_epi8(10, 11, 9, 10, 7, 8, 6, 7, \
+          4, 5, 3, 4, 1, 2, 0, 1)), set1_epi32(0x003f03f0)),               \
+          set1_epi32(0x01000010)))
+
+// Offsets that turn 6-bit indices into ASCII, selected by index range
+#define B64_ENC_OFFSETS(setr_epi8, url_safe) setr_epi8(                   \
+  'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,    \
+  '0' - 52, '0' - 52, '0' - 52, '0' - 52,                                  \
+  url_safe ? '-' - 62 : '+' - 62, url_safe ? '_' - 63 : '/' - 63, 'A', 0, 0)
+
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(const unsigned char *src, int len, char *dst,
+                               int url_safe) {
+  const __m128i offsets = B64_ENC_OFFSETS(_mm_setr_epi8, url_safe);
+  __m128i in, idx, res;
+  int i;
+
+  // Each step loads 16 bytes but consumes only 12
+  for (i = 0; i + 16 <= len; i += 12, dst += 16) {
+    in = _mm_loadu_si128((const __m128i *) (src + i));
+    idx = B64_ENC_RESHUFFLE(in, _mm_shuffle_epi8, _mm_and_si128,
+                            _mm_mulhi_epu16, _mm_mullo_epi16, _mm_or_si128,
+                            _mm_set1_epi32, _mm_set_epi8);
+    res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),
+                                                         idx),
+                                          _mm_set1_epi8(13)));
+    res = _mm_add_epi8(_mm_shuffle_epi8(offsets, res), idx);
+    _mm_storeu_si128((__m128i *) dst, res);
+  }
+
+  return i;
+}
+
+#define _mm256_set_epi8x2(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+  _mm256_set_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p,          \
+                  a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+#define _mm256_setr_epi8x2(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+  _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p,         \
+                   a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+__attribute__((target("avx2")))
+static int base64_encode_avx2(const unsigned char *src, int len, char *dst,
+                              int url_safe) {
+  const __m256i offsets = B64_ENC_OFFSETS(_mm256_setr_epi8x2, url_safe);
+  __m256i in, idx, res;
+  int i;
+
+  // Bytes 0..11 go to the low lane, bytes 12..23 to the high lane
+  for (i = 0; i + 28 <= len; i += 24, dst += 32) {
+    in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i *) (src + i))),
+        _mm_loadu_si128((const __m128i *) (src + i + 12)), 1);
+    idx = B64_ENC_RESHUFFLE(in, _mm256_shuffle_epi8, _mm256_and_si256,
+                            _mm256_mulhi_epu16, _mm256_mullo_epi16,
+                            _mm256_or_si256, _mm256_set1_epi32,
+                            _mm256_set_epi8x2);
+    res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    res = _mm256_or_si256(res, _mm256_and_si256(
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+    res = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, res), idx);
+    _mm256_storeu_si256((__m256i *) dst, res);
+  }
+
+  return i + base64_encode_ssse3(src + i, len - i, dst, url_safe);
+}
+
+// Validation and translation tables for the standard alphabet, indexed
+// by low and high nibbles of the input characters
+#define B64_DEC_LUT_LO(setr_epi8) setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, \
+  0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a)
+#define B64_DEC_LUT_HI(setr_epi8) setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, \
+  0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10)
+#define B64_DEC_LUT_ROLL(setr_epi8) setr_epi8(0, 16, 19, 4, -65, -65, -71, \
+  -71, 0, 0, 0, 0, 0, 0, 0, 0)
+
+// Decode 16 characters per step, stop at the first block that has
+// anything but the standard alphabet in it (including padding). The
+// caller must provide at least 4 bytes of extra room in dst.
+__attribute__((target("ssse3")))
+static int base64_decode_ssse3(const unsigned char *src, int len, char *dst) {
+  const __m128i lut_lo = B64_DEC_LUT_LO(_mm_setr_epi8);
+  const __m128i lut_hi = B64_DEC_LUT_HI(_mm_setr_epi8);
+  const __m128i lut_roll = B64_DEC_LUT_ROLL(_mm_setr_epi8);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i str, hi_nibbles, lo_nibbles, eq_2f;
+  int i;
+
+  for (i = 0; i + 16 <= len; i += 16, dst += 12) {
+    str = _mm_loadu_si128((const __m128i *) (src + i));
+    hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm_and_si128(str, mask_2f);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(
+        _mm_shuffle_epi8(lut_lo, lo_nibbles),
+        _mm_shuffle_epi8(lut_hi, hi_nibbles)), _mm_setzero_si128())) != 0) {
+      break;
+    }
+    eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    str = _mm_add_epi8(str, _mm_shuffle_epi8(lut_roll,
+                                             _mm_add_epi8(eq_2f, hi_nibbles)));
+    str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+    str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                              14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) dst, str);
+  }
+
+  return i;
+}
+
+// Same as above, 32 characters per step. Needs 8 bytes of extra room.
+__attribute__((target("avx2")))
+static int base64_decode_avx2(const unsigned char *src, int len, char *dst) {
+  const __m256i lut_lo = B64_DEC_LUT_LO(_mm256_setr_epi8x2);
+  const __m256i lut_hi = B64_DEC_LUT_HI(_mm256_setr_epi8x2);
+  const __m256i lut_roll = B64_DEC_LUT_ROLL(_mm256_setr_epi8x2);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  __m256i str, hi_nibbles, lo_nibbles, eq_2f;
+  int i;
+
+  for (i = 0; i + 32 <= len; i += 32, dst += 24) {
+    str = _mm256_loadu_si256((const __m256i *) (src + i));
+    hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm256_and_si256(str, mask_2f);
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(
+        _mm256_shuffle_epi8(lut_lo, lo_nibbles),
+        _mm256_shuffle_epi8(lut_hi, hi_nibbles)),
+        _mm256_setzero_si256())) != 0) {
+      break;
+    }
+    eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll,
+        _mm256_add_epi8(eq_2f, hi_nibbles)));
+    str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, _mm256_setr_epi8x2(2, 1, 0, 6, 5, 4, 10,
+                                                      9, 8, 14, 13, 12, -1,
+                                                      -1, -1, -1));
+    // Each lane holds 12 bytes of output, make them contiguous
+    str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5,
+                                                             6, 7, 7));
+    _mm256_storeu_si256((__m256i *) dst, str);
+  }
+
+  return i + base64_decode_ssse3(src + i, len - i, dst);
+}
+#endif  // NS_BASE64_X86
+
+// Encode src_len bytes of src into dst, which must have space for
+// NS_BASE64_ENCODED_SIZE(src_len) bytes. Flags are NS_BASE64_* bitmask.
+// Return length of the encoded, NUL-terminated string.
+int ns_base64_encode2(const unsigned char *src, int src_len, char *dst,
+                      int flags) {
+  const char *b64 = flags & NS_BASE64_URL_SAFE ?
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_" :
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  int i, j, a, b, c;
+  int i = 0, j = 0, a, b, c;
+
+#ifdef NS_BASE64_X86
+  switch (base64_simd_level()) {
+    case 2: i = base64_encode_avx2(src, src_len, dst,
+                                   flags & NS_BASE64_URL_SAFE); break;
+    case 1: i = base64_encode_ssse3(src, src_len, dst,
+                                    flags & NS_BASE64_URL_SAFE); break;
+  }
+  j = i / 3 * 4;
+#endif
 
-  for (i = j = 0; i < src_len; i += 3) {
+  for (; i + 3 <= src_len; i += 3) {
     a = src[i];
-    b = i + 1 >= src_len ? 0 : src[i + 1];
-    c = i + 2 >= src_len ? 0 : src[i + 2];
+    b = src[i + 1];
+    c = src[i + 2];
+    dst[j++] = b64[a >> 2];
+    dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
+    dst[j++] = b64[((b & 15) << 2) | (c >> 6)];
+    dst[j++] = b64[c & 63];
+  }
 
+  if (i < src_len) {
+    a = src[i];
+    b = i + 1 < src_len ? src[i + 1] : 0;
     dst[j++] = b64[a >> 2];
     dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
     if (i + 1 < src_len) {
-      dst[j++] = b64[(b & 15) << 2 | (c >> 6)];
+      dst[j++] = b64[(b & 15) << 2];
     }
-    if (i + 2 < src_len) {
-      dst[j++] = b64[c & 63];
+    while (!(flags & NS_BASE64_NO_PADDING) && j % 4 != 0) {
+      dst[j++] = '=';
     }
   }
-  while (j % 4 != 0) {
-    dst[j++] = '=';
-  }
-  dst[j++] = '\0';
+  dst[j] = '\0';
+
+  return j;
+}
+
+void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
+  ns_base64_encode2(src, src_len, dst, 0);
 }
 
 // Convert one byte of encoded base64 input stream to 6-bit chunk
@@ -1537,24 +5142,60 @@ static unsigned char from_b64(unsigned char ch) {
      41,  42,  43,  44,  45,  46,  47,  48, //  112
      49,  50,  51, 255, 255, 255, 255, 255, //  120
   };
-  return tab[ch & 127];
+  return ch & 128 ? 255 : tab[ch];
 }
 
-void ns_base64_decode(const unsigned char *s, int len, char *dst) {
+// 6-bit value of the i-th character. End of input counts as padding.
+static unsigned char b64_at(const unsigned char *s, int i, int len,
+                            int flags) {
+  unsigned char ch;
+
+  if (i >= len) return 200;
+  ch = s[i];
+  if (flags & NS_BASE64_URL_SAFE) {
+    if (ch == '-') ch = '+';
+    if (ch == '_') ch = '/';
+  }
+  return from_b64(ch);
+}
+
+// Decode base64 string s of length len into dst, which must have space
+// for NS_BASE64_DECODED_SIZE(len) bytes. Decoding stops at the padding or
+// at the first invalid character. Final quantum may be unpadded. Return
+// number of decoded bytes; dst is NUL-terminated.
+int ns_base64_decode2(const unsigned char *s, int len, char *dst,
+                      int flags) {
   unsigned char a, b, c, d;
-  while (len >= 4 &&
-         (a = from_b64(s[0])) != 255 &&
-         (b = from_b64(s[1])) != 255 &&
-         (c = from_b64(s[2])) != 255 &&
-         (d = from_b64(s[3])) != 255) {
+  int i = 0, n = 0;
+
+#ifdef NS_BASE64_X86
+  if (!(flags & NS_BASE64_URL_SAFE)) {
+    switch (base64_simd_level()) {
+      case 2: i = len >= 48 ? base64_decode_avx2(s, len - 16, dst) : 0; break;
+      case 1: i = len >= 24 ? base64_decode_ssse3(s, len - 8, dst) : 0; break;
+    }
+    n = i / 4 * 3;
+  }
+#endif
+
+  while (i + 1 < len &&
+         (a = b64_at(s, i, len, flags)) != 255 &&
+         (b = b64_at(s, i + 1, len, flags)) != 255 &&
+         (c = b64_at(s, i + 2, len, flags)) != 255 &&
+         (d = b64_at(s, i + 3, len, flags)) != 255) {
     if (a == 200 || b == 200) break;  // '=' can't be there
-    *dst++ = a << 2 | b >> 4;
+    dst[n++] = a << 2 | b >> 4;
     if (c == 200) break;
-    *dst++ = b << 4 | c >> 2;
+    dst[n++] = b << 4 | c >> 2;
     if (d == 200) break;
-    *dst++ = c << 6 | d;
-    s += 4;
-    len -=4;
+    dst[n++] = c << 6 | d;
+    i += 4;
   }
-  *dst = 0;
+  dst[n] = '\0';
+
+  return n;
+}
+
+void ns_base64_decode(const unsigned char *s, int len, char *dst) {
+  ns_base64_decode2(s, len, dst, 0);
 }
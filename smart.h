@@ -28,6 +28,9 @@
 #define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005+
 #undef WIN32_LEAN_AND_MEAN      // Let windows.h always include winsock2.h
 #define _XOPEN_SOURCE 600       // For flockfile() on Linux
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             // For accept4(), recvmmsg() and sendmmsg()
+#endif
 #define __STDC_FORMAT_MACROS    // <inttypes.h> wants this for C++
 #define __STDC_LIMIT_MACROS     // C++ wants that for INT64_MAX
 #ifndef _LARGEFILE_SOURCE
@@ -100,6 +103,20 @@ typedef struct _stati64 ns_stat_t;
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#if defined(__linux__) && !defined(NS_DISABLE_EVENTFD)
+#define NS_ENABLE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#if defined(__linux__) && !defined(NS_DISABLE_ACCEPT4)
+#define NS_ENABLE_ACCEPT4
+#endif
+#if defined(__linux__) && !defined(NS_DISABLE_MMSG)
+#define NS_ENABLE_MMSG
+#include <netinet/udp.h>
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define NS_ENABLE_UDP_OFFLOAD   // Kernel splits and joins UDP datagrams
+#endif
+#endif
 #define closesocket(x) close(x)
 #define __cdecl
 #define INVALID_SOCKET (-1)
@@ -124,6 +141,11 @@ typedef struct stat ns_stat_t;
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #endif
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #else
 typedef void *SSL;
 typedef void *SSL_CTX;
@@ -149,11 +171,27 @@ struct ns_str {
   size_t len;
 };
 
+// Size-classed cache of buffer memory, owned by ns_mgr. Buffers larger than
+// the largest class are allocated and freed directly.
+#define NS_BUF_POOL_CLASSES 4     // 4k, 16k, 64k, 1m
+struct ns_buf_pool {
+  struct {
+    size_t size;                  // Buffer size in this class
+    void *free_list;              // Cached buffers, linked through 1st bytes
+    size_t num_free;              // Number of cached buffers
+    size_t num_used;              // Buffers currently handed out
+    size_t num_gets;              // Total requests for this class
+    size_t num_hits;              // Requests served from the cache
+  } classes[NS_BUF_POOL_CLASSES];
+  size_t num_large;               // Oversized buffers currently handed out
+};
+
 // IO buffers interface
 struct iobuf {
   char *buf;
   size_t len;
   size_t size;
+  struct ns_buf_pool *pool;       // If not NULL, memory comes from the pool
 };
 
 void iobuf_init(struct iobuf *, size_t initial_size);
@@ -167,6 +205,18 @@ void iobuf_resize(struct iobuf *, size_t new_size);
 struct ns_connection;
 typedef void (*ns_callback_t)(struct ns_connection *, int event_num, void *evp);
 
+// Lock types used by the manager, see ns_mutex_lock() and friends
+#if defined(NS_DISABLE_THREADS)
+typedef int ns_mutex_t;
+typedef int ns_cond_t;
+#elif defined(_WIN32)
+typedef CRITICAL_SECTION ns_mutex_t;
+typedef CONDITION_VARIABLE ns_cond_t;
+#else
+typedef pthread_mutex_t ns_mutex_t;
+typedef pthread_cond_t ns_cond_t;
+#endif
+
 // Events. Meaning of event parameter (evp) is given in the comment.
 #define NS_POLL    0  // Sent to each connection on each call to ns_mgr_poll()
 #define NS_ACCEPT  1  // New connection accept()-ed. union socket_address *addr
@@ -174,33 +224,98 @@ typedef void (*ns_callback_t)(struct ns_connection *, int event_num, void *evp);
 #define NS_RECV    3  // Data has benn received. int *num_bytes
 #define NS_SEND    4  // Data has been written to a socket. int *num_bytes
 #define NS_CLOSE   5  // Connection is closed. NULL
+#define NS_TIMER   6  // Timer set by ns_set_timer() has expired. time_t *now
+#define NS_JOB_DONE 7 // Job from ns_submit_job() has finished. void *job_data
+#define NS_UDP_DATAGRAM 8     // See NSF_UDP_DATAGRAM. struct ns_udp_datagram *
+#define NS_UDP_SESSION_END 9  // UDP peer went idle. struct ns_udp_session *
+#define NS_SEND_BLOCKED 10    // send_iobuf reached high watermark. size_t *len
+#define NS_SEND_DRAINED 11    // send_iobuf fell to low watermark. size_t *len
+#define NS_UDP_BATCH 12       // See ns_set_udp_batch(). struct ns_udp_batch *
+
+
+// Reference to a connection that can be kept after it is closed, or passed
+// to another thread. See ns_handle() and ns_post().
+struct ns_handle {
+  unsigned int id;                  // ns_connection::id
+  unsigned int gen;                 // ns_connection::gen
+};
 
+// Cross-thread message, see ns_broadcast() and ns_post()
+struct ns_ctl_msg {
+  struct ns_ctl_msg *volatile next;
+  ns_callback_t callback;
+  void *data;                       // Message passed to the callback
+  volatile int done;                // Set by the loop for ns_broadcast()
+  int is_async;                     // Allocated by ns_broadcast_async()
+  int is_targeted;                  // Deliver to "target" only, see ns_post()
+  struct ns_handle target;
+};
 
 struct ns_mgr {
   struct ns_connection *active_connections;
   const char *hexdump_file;         // Debug hexdump file path
-  sock_t ctl[2];                    // Socketpair for mg_wakeup()
+  sock_t ctl[2];                    // Wakeup socketpair or eventfd
+  struct ns_ctl_msg *ctl_head;      // Lock-free queue, producers push here
+  struct ns_ctl_msg *ctl_tail;      // Event loop pops from here
+  struct ns_ctl_msg ctl_stub;       // Queue sentinel
+  volatile int ctl_wakeup_pending;  // ctl wakeup is sent but not consumed
+  ns_mutex_t ctl_lock;              // Guards ns_ctl_msg::done
+  ns_cond_t ctl_done;               // Signalled when ns_broadcast() is done
+  struct ns_workers *workers;       // See ns_mgr_start_workers()
+  const char *nameserver;           // DNS server IP:PORT, default: resolv.conf
+                                    // Without either, lookups fail
+  struct ns_dns *dns;               // See ns_resolve_async()
   void *user_data;                  // User data
+  unsigned char rnd_pool[256];      // Batch of random bytes for ns_random()
+  size_t rnd_pos;                   // Number of rnd_pool bytes already used
+  struct ns_buf_pool buf_pool;      // Memory for connection iobufs
+  struct ns_conn_slab **conn_slabs; // Memory for connection objects
+  struct ns_connection *free_conns; // Unused objects in conn_slabs
+  size_t num_conn_slabs;            // Size of the conn_slabs array
+  char *udp_buf;                    // Datagrams of one batched UDP read
+  size_t udp_buf_size;              // Allocated size of udp_buf
+  int accept_budget;                // Max accept()s per listener per poll
+  uint64_t now_ms;                  // Monotonic clock, see ns_monotonic_ms()
+  time_t now;                       // Wall clock, updated with now_ms
+#ifdef NS_ENABLE_SSL
+  struct ns_client_ssl_ctx *client_ssl_ctxs;  // Shared client SSL_CTXs
+  struct ns_ssl_workers *ssl_workers;  // See ns_mgr_start_ssl_workers()
+#endif
 };
 
 
 struct ns_connection {
-  struct ns_connection *next, *prev;  // ns_mgr::active_connections linkage
-  struct ns_connection *listener;     // Set only for accept()-ed connections
+  // Fields read by ns_mgr_poll() for every connection come first, so that
+  // a scan over a connection slab touches one cache line per connection.
+  unsigned int flags;         // NSF_* flags, see below
+  sock_t sock;                // Socket
+  uint64_t ev_timer_ms;       // ns_mgr::now_ms of the future NS_TIMER event
+  struct iobuf send_iobuf;    // Data scheduled for sending
+  ns_callback_t callback;     // Event handler function
   struct ns_mgr *mgr;
 
-  sock_t sock;                // Socket
+  // Cold part, touched only when the connection has IO or events
+  struct ns_connection *next, *prev;  // ns_mgr::active_connections linkage
+  struct ns_connection *listener;     // Set only for accept()-ed connections
+  unsigned int id;            // Stable slot number, see ns_conn_by_id()
+  unsigned int gen;           // Bumped each time the slot is freed
   union socket_address sa;    // Peer address
   struct iobuf recv_iobuf;    // Received data
-  struct iobuf send_iobuf;    // Data scheduled for sending
   SSL *ssl;
-  SSL_CTX *ssl_ctx;
+  SSL_CTX *ssl_ctx;           // Accepted ones create SSL from it lazily
   void *user_data;            // User-specific data
   void *proto_data;           // Application protocol-specific data
+  int ws_ping_interval;       // Websocket keepalive ping interval, seconds
+  int ws_max_missed_pongs;    // Close websocket after that many lost pongs
+  int ws_missed_pongs;        // Keepalive pings not answered so far
+  time_t ev_timer_time;       // Timestamp of the future NS_TIMER event
   time_t last_io_time;        // Timestamp of the last socket IO
-  ns_callback_t callback;     // Event handler function
+  uint64_t last_io_ms;        // ns_mgr::now_ms of the last socket IO
+  struct ns_udp_sessions *udp_sessions;  // See ns_set_udp_sessions()
+  size_t send_high_wm;        // See ns_set_send_watermarks()
+  size_t send_low_wm;
+  struct ns_connection *flow_peer;  // See ns_set_flow_peer()
 
-  unsigned int flags;
 #define NSF_FINISHED_SENDING_DATA   (1 << 0)
 #define NSF_BUFFER_BUT_DONT_SEND    (1 << 1)
 #define NSF_SSL_HANDSHAKE_DONE      (1 << 2)
@@ -210,6 +325,16 @@ struct ns_connection {
 #define NSF_WANT_WRITE              (1 << 6)
 #define NSF_LISTENING               (1 << 7)
 #define NSF_UDP                     (1 << 8)
+#define NSF_KTLS_SEND               (1 << 9)   // Kernel encrypts sent data
+#define NSF_SSL_OFFLOADED           (1 << 10)  // Handshake runs on a worker
+#define NSF_UNUSED                  (1 << 11)  // Free slab slot, internal
+#define NSF_RESOLVING               (1 << 12)  // Waiting for DNS reply
+#define NSF_UDP_DATAGRAM            (1 << 13)  // Listener gets NS_UDP_DATAGRAM
+#define NSF_UDP_GSO                 (1 << 14)  // See ns_set_udp_offload()
+#define NSF_UDP_GRO                 (1 << 15)  // See ns_set_udp_offload()
+#define NSF_SEND_BLOCKED            (1 << 16)  // Above high watermark
+#define NSF_DONT_RECV               (1 << 17)  // Don't read from the socket
+#define NSF_UDP_BATCH               (1 << 18)  // See ns_set_udp_batch()
 
 #define NSF_USER_1                  (1 << 20)
 #define NSF_USER_2                  (1 << 21)
@@ -219,12 +344,78 @@ struct ns_connection {
 #define NSF_USER_6                  (1 << 25)
 };
 
+// Memory used by a manager, see ns_mgr_mem_report()
+struct ns_mem_report {
+  size_t num_conns;           // Connections, including listeners
+  size_t num_free_conns;      // Connection objects ready for reuse
+  size_t conn_bytes;          // Memory taken by connection slabs
+  size_t recv_buf_bytes;      // Allocated size of all recv_iobufs
+  size_t send_buf_bytes;      // Allocated size of all send_iobufs
+  size_t pool_free_bytes;     // Memory cached in the manager's buffer pool
+  size_t num_ssl;             // Connections with an SSL object
+  size_t num_ssl_deferred;    // Accepted SSL connections not read from yet
+};
+
+// Per-peer state of a UDP listener, see ns_set_udp_sessions()
+struct ns_udp_session {
+  struct ns_udp_session *next;      // Hash chain, internal
+  union socket_address peer;
+  time_t last_io_time;              // When the peer last sent a datagram
+  void *user_data;                  // Free for the event handler to use
+};
+
+// UDP listener with NSF_UDP_DATAGRAM set passes each datagram to its own
+// event handler as NS_UDP_DATAGRAM, instead of making a temporary
+// connection for NS_RECV. Reply with ns_send_to(), now or later.
+struct ns_udp_datagram {
+  union socket_address peer;        // Sender
+  const char *data;
+  size_t len;
+  struct ns_udp_session *session;   // Sender's session, or NULL
+};
+
+// Datagrams read from a UDP listener in one go, see ns_set_udp_batch().
+// Data pointers are valid only while NS_UDP_BATCH is handled.
+struct ns_udp_batch {
+  struct ns_udp_datagram *datagrams;
+  int num;
+};
+
+// Blocking work for ns_submit_job(), runs on a worker thread
+typedef void (*ns_job_fn_t)(void *job_data);
+
+// Worker pool state, see ns_mgr_job_stats()
+struct ns_job_stats {
+  size_t num_threads;         // Running worker threads
+  size_t num_queued;          // Jobs waiting for a worker
+  size_t num_running;         // Jobs being run by workers
+  size_t max_queued;          // Queue limit, ns_submit_job() fails above it
+  size_t peak_queued;         // Highest num_queued seen
+  size_t num_submitted;       // Jobs accepted by ns_submit_job()
+  size_t num_completed;       // Jobs finished by workers
+  size_t num_rejected;        // Jobs refused because the queue was full
+};
+
 void ns_mgr_init(struct ns_mgr *, void *user_data);
 void ns_mgr_free(struct ns_mgr *);
 time_t ns_mgr_poll(struct ns_mgr *, int milli);
+void ns_mgr_mem_report(struct ns_mgr *, struct ns_mem_report *);
 void ns_broadcast(struct ns_mgr *, ns_callback_t, void *, size_t);
+int ns_broadcast_async(struct ns_mgr *, ns_callback_t, const void *, size_t);
+int ns_mgr_start_workers(struct ns_mgr *, int num_threads, int max_queued);
+void ns_mgr_job_stats(struct ns_mgr *, struct ns_job_stats *);
+#ifdef NS_ENABLE_SSL
+int ns_mgr_start_ssl_workers(struct ns_mgr *, int num_threads);
+#endif
 
 struct ns_connection *ns_next(struct ns_mgr *, struct ns_connection *);
+struct ns_connection *ns_conn_by_id(struct ns_mgr *, unsigned int id);
+struct ns_handle ns_handle(struct ns_connection *);
+struct ns_connection *ns_handle_conn(struct ns_mgr *, struct ns_handle);
+int ns_post(struct ns_mgr *, struct ns_handle, ns_callback_t,
+            const void *data, size_t len);
+int ns_submit_job(struct ns_connection *, ns_job_fn_t,
+                  const void *job_data, size_t len);
 struct ns_connection *ns_add_sock(struct ns_mgr *, sock_t,
                                   ns_callback_t, void *);
 struct ns_connection *ns_bind(struct ns_mgr *, const char *,
@@ -233,11 +424,22 @@ struct ns_connection *ns_connect(struct ns_mgr *, const char *,
                                  ns_callback_t, void *);
 
 int ns_send(struct ns_connection *, const void *buf, int len);
+int ns_send_to(struct ns_connection *, const union socket_address *,
+               const void *buf, int len);
+int ns_set_udp_sessions(struct ns_connection *, int idle_timeout);
+int ns_set_udp_offload(struct ns_connection *, int gso, int gro);
+int ns_set_udp_batch(struct ns_connection *, int on);
 int ns_printf(struct ns_connection *, const char *fmt, ...);
 int ns_vprintf(struct ns_connection *, const char *fmt, va_list ap);
+time_t ns_set_timer(struct ns_connection *, time_t timestamp);
+void ns_set_send_watermarks(struct ns_connection *, size_t high, size_t low);
+void ns_set_flow_peer(struct ns_connection *, struct ns_connection *);
+uint64_t ns_set_timer_ms(struct ns_connection *, uint64_t deadline_ms);
 
 // Utility functions
 void *ns_start_thread(void *(*f)(void *), void *p);
+uint64_t ns_monotonic_ms(void);
+uint64_t ns_monotonic_ns(void);
 int ns_socketpair(sock_t [2]);
 int ns_socketpair2(sock_t [2], int sock_type);  // SOCK_STREAM or SOCK_DGRAM
 void ns_set_close_on_exec(sock_t);
@@ -246,6 +448,26 @@ int ns_hexdump(const void *buf, int len, char *dst, int dst_len);
 int ns_avprintf(char **buf, size_t size, const char *fmt, va_list ap);
 int ns_resolve(const char *domain_name, char *ip_addr_buf, size_t buf_len);
 
+// Asynchronous DNS. Callback gets NULL addr if the name cannot be resolved.
+#define NS_DNS_A     1    // IPv4 address query type
+#define NS_DNS_AAAA  28   // IPv6 address query type, needs NS_ENABLE_IPV6
+typedef void (*ns_resolve_cb_t)(struct ns_mgr *, const char *name,
+                                union socket_address *addr, void *user_data);
+int ns_resolve_async(struct ns_mgr *, const char *name, int query_type,
+                     ns_resolve_cb_t, void *user_data);
+
+// DNS cache counters, see ns_mgr_dns_stats()
+struct ns_dns_stats {
+  size_t hits;                // Answered from fresh cache entries
+  size_t stale_hits;          // Answered from expired entries being refreshed
+  size_t negative_hits;       // Names cached as non-existent
+  size_t misses;              // Lookups that needed a query
+  size_t queries_sent;        // Including retries and refreshes
+  size_t num_entries;         // Names in the cache
+};
+void ns_mgr_dns_stats(struct ns_mgr *, struct ns_dns_stats *);
+int ns_random(struct ns_mgr *, void *buf, size_t len);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -289,6 +511,17 @@ int ns_vcasecmp(const struct ns_str *str2, const char *str1);
 void ns_base64_decode(const unsigned char *s, int len, char *dst);
 void ns_base64_encode(const unsigned char *src, int src_len, char *dst);
 
+#define NS_BASE64_URL_SAFE    1   // Use '-' and '_' instead of '+' and '/'
+#define NS_BASE64_NO_PADDING  2   // Do not append '=' when encoding
+
+// Destination buffer sizes, including the terminating NUL
+#define NS_BASE64_ENCODED_SIZE(n) (((n) + 2) / 3 * 4 + 1)
+#define NS_BASE64_DECODED_SIZE(n) ((n) / 4 * 3 + 3)
+
+int ns_base64_encode2(const unsigned char *src, int src_len, char *dst,
+                      int flags);
+int ns_base64_decode2(const unsigned char *s, int len, char *dst, int flags);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -337,6 +570,7 @@ struct websocket_message {
 #define NS_WEBSOCKET_HANDSHAKE_DONE     112   // NULL
 #define NS_WEBSOCKET_FRAME              113   // struct websocket_message *
 #define NS_WEBSOCKET_NOT_SUPPORTED      114   // NULL
+#define NS_WEBSOCKET_CONTROL_FRAME      115   // struct websocket_message *
 
 struct ns_connection *ns_bind_http(struct ns_mgr *mgr, const char *addr,
                                    ns_callback_t cb, void *user_data);
@@ -350,6 +584,19 @@ struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
 
 void ns_send_websocket(struct ns_connection *, int op, const void *, size_t);
 void ns_printf_websocket(struct ns_connection *, int op, const char *, ...);
+void ns_set_websocket_keepalive(struct ns_connection *, int interval,
+                                int max_missed_pongs);
+
+// Pool of client connections, reused for requests to the same address.
+// Requests above max_conns_per_host wait in a queue. Idle connections are
+// closed after idle_timeout seconds, or kept until the server closes them if
+// idle_timeout is 0. Must be freed before the manager.
+struct ns_http_pool *ns_http_pool_new(struct ns_mgr *, int max_conns_per_host,
+                                      int idle_timeout);
+void ns_http_pool_free(struct ns_http_pool *);
+int ns_http_pool_request(struct ns_http_pool *, const char *addr,
+                         ns_callback_t cb, void *user_data,
+                         const char *fmt, ...);
 
 // Websocket opcodes, from http://tools.ietf.org/html/rfc6455
 #define WEBSOCKET_OP_CONTINUE  0
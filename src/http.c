@@ -6,6 +6,10 @@
 #include "util.h"
 #include "http.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Check whether full request is buffered. Return:
 //   -1  if request is malformed
 //    0  if request is not yet fully buffered
@@ -28,6 +32,22 @@ static int get_request_len(const char *s, int buf_len) {
   return 0;
 }
 
+// Replies with these codes never have a body, RFC 7230 section 3.3.3.
+// In a reply, the protocol is parsed into "method" and the code into "uri".
+static int http_reply_without_body(const struct http_message *hm) {
+  const char *code = hm->uri.p;
+  return hm->method.len > 5 && memcmp(hm->method.p, "HTTP/", 5) == 0 &&
+    hm->uri.len == 3 && (code[0] == '1' || memcmp(code, "204", 3) == 0 ||
+                         memcmp(code, "304", 3) == 0);
+}
+
+// 1xx replies other than 101 Switching Protocols precede the final reply
+// to the same request, RFC 7231 section 6.2
+static int http_reply_is_interim(const struct http_message *hm) {
+  return http_reply_without_body(hm) && hm->uri.p[0] == '1' &&
+    memcmp(hm->uri.p, "101", 3) != 0;
+}
+
 static int parse_http(const char *s, int n, struct http_message *req) {
   const char *end;
   int len, i;
@@ -70,7 +90,10 @@ static int parse_http(const char *s, int n, struct http_message *req) {
     }
   }
 
-  if (req->body.len == (size_t) ~0 && ns_vcasecmp(&req->method, "GET") == 0) {
+  if (http_reply_without_body(req) ||
+      (req->body.len == (size_t) ~0 &&
+       (ns_vcasecmp(&req->method, "GET") == 0 ||
+        ns_vcasecmp(&req->method, "HEAD") == 0))) {
     req->body.len = 0;
     req->message.len = len;
   }
@@ -89,10 +112,46 @@ struct ns_str *get_http_header(struct http_message *hm, const char *name) {
   return NULL;
 }
 
+// XOR data with the 4-byte websocket mask. Works in place (dst == src).
+// Data is processed a vector or a word at a time; as the chunk sizes are
+// multiples of 4, the mask stays aligned with the data.
+static void ns_mask_ws_data(unsigned char *dst, const unsigned char *src,
+                            size_t len, const unsigned char mask[4]) {
+  uint64_t m8, w;
+  size_t i = 0;
+
+  memcpy(&m8, mask, 4);
+  memcpy((unsigned char *) &m8 + 4, mask, 4);
+
+#ifdef __SSE2__
+  {
+    __m128i m16 = _mm_set1_epi64x((long long) m8);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(v, m16));
+    }
+  }
+#endif
+
+  for (; i + 8 <= len; i += 8) {
+    memcpy(&w, src + i, 8);
+    w ^= m8;
+    memcpy(dst + i, &w, 8);
+  }
+  for (; i < len; i++) {
+    dst[i] = src[i] ^ mask[i % 4];
+  }
+}
+
+static int is_ws_control_frame(unsigned flags) {
+  return (flags & 0x0f) == WEBSOCKET_OP_PING ||
+    (flags & 0x0f) == WEBSOCKET_OP_PONG;
+}
+
 static int deliver_websocket_data(struct ns_connection *nc) {
   // Having buf unsigned char * is important, as it is used below in arithmetic
   unsigned char *buf = (unsigned char *) nc->recv_iobuf.buf;
-  uint64_t i, data_len = 0, frame_len = 0, buf_len = nc->recv_iobuf.len,
+  uint64_t data_len = 0, frame_len = 0, buf_len = nc->recv_iobuf.len,
   len, mask_len = 0, header_len = 0, ok;
 
   if (buf_len >= 2) {
@@ -123,13 +182,21 @@ static int deliver_websocket_data(struct ns_connection *nc) {
 
     // Apply mask if necessary
     if (mask_len > 0) {
-      for (i = 0; i < data_len; i++) {
-        buf[i + header_len] ^= (buf + header_len - mask_len)[i % 4];
-      }
+      ns_mask_ws_data(wsm.data, wsm.data, wsm.size, wsm.data - mask_len);
+    }
+
+    // Any frame from the peer proves it is alive
+    nc->ws_missed_pongs = 0;
+
+    // Answer pings automatically. Ping and pong frames are delivered to the
+    // event handler as control frames, not mixed with the data frames.
+    if ((wsm.flags & 0x0f) == WEBSOCKET_OP_PING) {
+      ns_send_websocket(nc, WEBSOCKET_OP_PONG, wsm.data, wsm.size);
     }
 
     // Call event handler
-    ((ns_callback_t) nc->proto_data)(nc, NS_WEBSOCKET_FRAME, &wsm);
+    ((ns_callback_t) nc->proto_data)(nc, is_ws_control_frame(wsm.flags) ?
+      NS_WEBSOCKET_CONTROL_FRAME : NS_WEBSOCKET_FRAME, &wsm);
 
     // Remove frame from the iobuf
     iobuf_remove(&nc->recv_iobuf, frame_len);
@@ -138,15 +205,24 @@ static int deliver_websocket_data(struct ns_connection *nc) {
   return ok;
 }
 
-static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len) {
+// Largest websocket frame header: 2 bytes, 8 bytes of extended length
+// and 4 bytes of mask
+#define NS_WS_MAX_HEADER_SIZE 14
+
+// Payload space initially reserved by ns_printf_websocket()
+#define NS_WS_PRINTF_RESERVE 256
+
+// Encode websocket frame header into the buffer, return header length.
+// If mask is not NULL, mark the frame as masked and append the mask.
+static int ns_encode_ws_header(unsigned char *header, int op, size_t len,
+                               const unsigned char *mask) {
   int header_len;
-  unsigned char header[10];
 
   header[0] = 0x80 + (op & 0x0f);
   if (len < 126) {
     header[1] = len;
     header_len = 2;
-  } else if (len < 65535) {
+  } else if (len < 65536) {
     header[1] = 126;
     * (uint16_t *) &header[2] = htons((uint16_t) len);
     header_len = 4;
@@ -156,33 +232,138 @@ static void ns_send_ws_header(struct ns_connection *nc, int op, size_t len) {
     * (uint32_t *) &header[6] = htonl((uint32_t) (len & 0xffffffff));
     header_len = 10;
   }
-  ns_send(nc, header, header_len);
+
+  if (mask != NULL) {
+    header[1] |= 0x80;
+    memcpy(header + header_len, mask, 4);
+    header_len += 4;
+  }
+
+  return header_len;
 }
 
-void ns_send_websocket(struct ns_connection *nc, int op,
-                       const void *data, size_t len) {
-  ns_send_ws_header(nc, op, len);
-  ns_send(nc, data, len);
+// Frames sent by the client must be masked, RFC 6455 section 5.3. Set
+// *mask to the mask to use, or NULL for the server side. Return -1 and
+// close the connection if no unpredictable mask can be made.
+static int ns_ws_mask(struct ns_connection *nc, unsigned char buf[4],
+                      unsigned char **mask) {
+  *mask = NULL;
+  if (nc->listener != NULL) return 0;
+  if (ns_random(nc->mgr, buf, 4) != 0) {
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+    return -1;
+  }
+  *mask = buf;
+  return 0;
+}
 
+// Make sure that n more bytes can be appended to the iobuf without
+// reallocation. Unlike iobuf_resize(), never shrinks the buffer.
+static int ns_ws_reserve(struct iobuf *io, size_t n) {
+  if (io->len + n > io->size) {
+    iobuf_resize(io, io->len + n);
+  }
+  return io->len + n <= io->size;
+}
+
+static void ns_ws_frame_queued(struct ns_connection *nc, int op) {
   if (op == WEBSOCKET_OP_CLOSE) {
     nc->flags |= NSF_FINISHED_SENDING_DATA;
   }
 }
 
+void ns_send_websocket(struct ns_connection *nc, int op,
+                       const void *data, size_t len) {
+  struct iobuf *io = &nc->send_iobuf;
+  unsigned char header[NS_WS_MAX_HEADER_SIZE], mask_buf[4], *mask, *p;
+  int header_len;
+
+  if (ns_ws_mask(nc, mask_buf, &mask) != 0) return;
+  header_len = ns_encode_ws_header(header, op, len, mask);
+
+  // Append the whole frame at once, growing the send buffer at most once.
+  // Client frames are masked while being copied.
+  if (ns_ws_reserve(io, header_len + len)) {
+    p = (unsigned char *) io->buf + io->len;
+    memcpy(p, header, header_len);
+    if (len > 0 && mask != NULL) {
+      ns_mask_ws_data(p + header_len, (const unsigned char *) data, len, mask);
+    } else if (len > 0) {
+      memcpy(p + header_len, data, len);
+    }
+    io->len += header_len + len;
+    ns_check_watermarks(nc);
+  }
+
+  ns_ws_frame_queued(nc, op);
+}
+
 void ns_printf_websocket(struct ns_connection *nc, int op,
                          const char *fmt, ...) {
-  char mem[4192], *buf = mem;
+  struct iobuf *io = &nc->send_iobuf;
+  unsigned char header[NS_WS_MAX_HEADER_SIZE], mask_buf[4], *mask, *p;
+  size_t avail = NS_WS_PRINTF_RESERVE;
+  int short_len, header_len, len = -1;
   va_list ap;
-  int len;
 
-  va_start(ap, fmt);
-  if ((len = ns_avprintf(&buf, sizeof(mem), fmt, ap)) > 0) {
-    ns_send_websocket(nc, op, buf, len);
+  if (ns_ws_mask(nc, mask_buf, &mask) != 0) return;
+  short_len = mask == NULL ? 2 : 6;
+
+  // Format the payload straight into the send buffer, behind the room for
+  // a short header. Small frames, which are the common case, are then
+  // complete without any copying. If the payload does not fit, grow the
+  // buffer and format again.
+  while (ns_ws_reserve(io, NS_WS_MAX_HEADER_SIZE + avail)) {
+    va_start(ap, fmt);
+    len = vsnprintf(io->buf + io->len + short_len, avail, fmt, ap);
+    va_end(ap);
+    if (len >= 0 && (size_t) len < avail) break;
+    // eCos and Windows return -1 when the buffer is too small
+    avail = len < 0 ? avail * 2 : (size_t) len + 1;
+    len = -1;
   }
-  va_end(ap);
 
-  if (buf != mem && buf != NULL) {
-    free(buf);
+  if (len > 0) {
+    p = (unsigned char *) io->buf + io->len;
+    header_len = ns_encode_ws_header(header, op, len, mask);
+    if (header_len > short_len) {
+      memmove(p + header_len, p + short_len, len);
+    }
+    memcpy(p, header, header_len);
+    if (mask != NULL) {
+      ns_mask_ws_data(p + header_len, p + header_len, len, mask);
+    }
+    io->len += header_len + len;
+    ns_check_watermarks(nc);
+    ns_ws_frame_queued(nc, op);
+  }
+}
+
+// Set up websocket keepalive: ping the peer every "interval" seconds,
+// and close the connection if "max_missed_pongs" pings in a row stay
+// unanswered. Zero interval disables keepalive. When called for a
+// listening connection, settings apply to all accepted connections.
+// Keepalive uses connection's timer, see ns_set_timer().
+void ns_set_websocket_keepalive(struct ns_connection *nc, int interval,
+                                int max_missed_pongs) {
+  nc->ws_ping_interval = interval;
+  nc->ws_max_missed_pongs = max_missed_pongs;
+  nc->ws_missed_pongs = 0;
+  if (nc->flags & NSF_USER_1) {
+    ns_set_timer_ms(nc, interval > 0 ? nc->mgr->now_ms + interval * 1000 : 0);
+  }
+}
+
+static void websocket_keepalive(struct ns_connection *nc) {
+  if (nc->ws_ping_interval <= 0) {
+    // Keepalive is disabled, timer belongs to the user
+  } else if (nc->ws_missed_pongs >= nc->ws_max_missed_pongs) {
+    DBG(("%p dead peer, %d pings unanswered", nc, nc->ws_missed_pongs));
+    nc->flags |= NSF_CLOSE_IMMEDIATELY;
+  } else {
+    ns_send_websocket(nc, WEBSOCKET_OP_PING, NULL, 0);
+    nc->ws_missed_pongs++;
+    ns_set_timer_ms(nc, nc->mgr->now_ms + nc->ws_ping_interval * 1000);
   }
 }
 
@@ -195,11 +376,21 @@ static void websocket_handler(struct ns_connection *nc, int ev, void *ev_data) {
     case NS_RECV:
       do { } while (deliver_websocket_data(nc));
       break;
+    case NS_TIMER:
+      websocket_keepalive(nc);
+      break;
     default:
       break;
   }
 }
 
+static void ws_handshake_done(struct ns_connection *nc, ns_callback_t cb) {
+  if (nc->ws_ping_interval > 0) {
+    ns_set_timer_ms(nc, nc->mgr->now_ms + nc->ws_ping_interval * 1000);
+  }
+  cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+}
+
 static void send_websocket_handshake(struct ns_connection *nc,
                                      const struct ns_str *key) {
   static const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -225,48 +416,60 @@ static void http_handler(struct ns_connection *nc, int ev, void *ev_data) {
   ns_callback_t cb = (ns_callback_t) nc->proto_data;
   struct http_message hm;
   struct ns_str *vec;
-  int req_len;
+  int req_len, interim;
+
+  if (ev == NS_ACCEPT) {
+    // Inherit websocket keepalive settings from the listener
+    nc->ws_ping_interval = nc->listener->ws_ping_interval;
+    nc->ws_max_missed_pongs = nc->listener->ws_max_missed_pongs;
+  }
 
   cb(nc, ev, ev_data);
 
   switch (ev) {
 
     case NS_RECV:
-      req_len = parse_http(io->buf, io->len, &hm);
-      if (req_len < 0 || io->len >= NS_MAX_HTTP_REQUEST_SIZE) {
-        nc->flags |= NSF_CLOSE_IMMEDIATELY;
-      } else if (req_len == 0) {
-        // Do nothing, request is not yet fully buffered
-      } else if (nc->listener == NULL &&
-                 get_http_header(&hm, "Sec-WebSocket-Accept")) {
-        // We're websocket client, got handshake response from server.
-        // TODO(lsm): check the validity of accept Sec-WebSocket-Accept
-        iobuf_remove(io, req_len);
-        nc->callback = websocket_handler;
-        nc->flags |= NSF_USER_1;
-        cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
-        websocket_handler(nc, NS_RECV, ev_data);
-      } else if (nc->listener != NULL &&
-                 (vec = get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
-        // This is a websocket request. Switch protocol handlers.
-        iobuf_remove(io, req_len);
-        nc->callback = websocket_handler;
-        nc->flags |= NSF_USER_1;
-
-        // Send handshake
-        cb(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, NULL);
-        if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
-          if (nc->send_iobuf.len == 0) {
-            send_websocket_handshake(nc, vec);
-          }
-          cb(nc, NS_WEBSOCKET_HANDSHAKE_DONE, NULL);
+      // Final reply may have arrived together with interim 1xx ones
+      do {
+        interim = 0;
+        req_len = parse_http(io->buf, io->len, &hm);
+        if (req_len < 0 || io->len >= NS_MAX_HTTP_REQUEST_SIZE) {
+          nc->flags |= NSF_CLOSE_IMMEDIATELY;
+        } else if (req_len == 0) {
+          // Do nothing, request is not yet fully buffered
+        } else if (nc->listener == NULL &&
+                   get_http_header(&hm, "Sec-WebSocket-Accept")) {
+          // We're websocket client, got handshake response from server.
+          // TODO(lsm): check the validity of accept Sec-WebSocket-Accept
+          iobuf_remove(io, req_len);
+          nc->callback = websocket_handler;
+          nc->flags |= NSF_USER_1;
+          ws_handshake_done(nc, cb);
           websocket_handler(nc, NS_RECV, ev_data);
+        } else if (nc->listener != NULL &&
+                   (vec = get_http_header(&hm, "Sec-WebSocket-Key")) != NULL) {
+          // This is a websocket request. Switch protocol handlers.
+          iobuf_remove(io, req_len);
+          nc->callback = websocket_handler;
+          nc->flags |= NSF_USER_1;
+
+          // Send handshake
+          cb(nc, NS_WEBSOCKET_HANDSHAKE_REQUEST, NULL);
+          if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+            if (nc->send_iobuf.len == 0) {
+              send_websocket_handshake(nc, vec);
+            }
+            ws_handshake_done(nc, cb);
+            websocket_handler(nc, NS_RECV, ev_data);
+          }
+        } else if (hm.message.len <= io->len) {
+          // Whole HTTP message is fully buffered, call event handler
+          interim = nc->listener == NULL && http_reply_is_interim(&hm);
+          if (cb) cb(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
+          iobuf_remove(io, hm.message.len);
         }
-      } else if (hm.message.len <= io->len) {
-        // Whole HTTP message is fully buffered, call event handler
-        if (cb) cb(nc, nc->listener ? NS_HTTP_REQUEST : NS_HTTP_REPLY, &hm);
-        iobuf_remove(io, hm.message.len);
-      }
+      } while (interim && io->len > 0 &&
+               !(nc->flags & NSF_CLOSE_IMMEDIATELY));
       break;
 
     case NS_CLOSE:
@@ -303,14 +506,15 @@ struct ns_connection *ns_connect_http(struct ns_mgr *mgr, const char *addr,
 struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
                                            ns_callback_t cb, void *udata,
                                            const char *uri, const char *hdrs) {
-  struct ns_connection *nc = ns_connect(mgr, addr, http_handler, udata);
+  struct ns_connection *nc = NULL;
+  unsigned char nonce[16];
+  char key[sizeof(nonce) * 2];
 
-  if (nc != NULL) {
-    unsigned long random = (unsigned long) uri;
-    char key[sizeof(random) * 2];
+  // The key must not be predictable, so no connection without one
+  if (ns_random(mgr, nonce, sizeof(nonce)) == 0 &&
+      (nc = ns_connect(mgr, addr, http_handler, udata)) != NULL) {
     nc->proto_data = (void *) cb;
-
-    ns_base64_encode((unsigned char *) &random, sizeof(random), key);
+    ns_base64_encode(nonce, sizeof(nonce), key);
     ns_printf(nc, "GET %s HTTP/1.1\r\n"
               "Upgrade: websocket\r\n"
               "Connection: Upgrade\r\n"
@@ -322,6 +526,318 @@ struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
   return nc;
 }
 
+// Pooled client connections. A pool host holds the connections opened to
+// one address, plus a FIFO of requests waiting for a free connection. The
+// address string is the key, so "ssl://" connections never mix with plain.
+struct http_pool_req {
+  struct http_pool_req *next;
+  ns_callback_t cb;
+  void *user_data;
+  int retried;
+  size_t len;
+  char buf[1];  // Request bytes, allocated together with the struct
+};
+
+struct http_pool_conn {
+  struct http_pool_conn *next;
+  struct ns_connection *nc;
+  struct http_pool_host *host;
+  struct http_pool_req *req;    // Request in flight, NULL if idle
+  int num_reqs;                 // Requests completed on this connection
+};
+
+struct http_pool_host {
+  struct http_pool_host *next;
+  struct ns_http_pool *pool;
+  char addr[100];
+  int num_conns;
+  struct http_pool_conn *conns;
+  struct http_pool_req *queue, *queue_tail;
+};
+
+struct ns_http_pool {
+  struct ns_mgr *mgr;
+  int max_conns_per_host;
+  int idle_timeout;
+  struct http_pool_host *hosts;
+};
+
+static void http_pool_handler(struct ns_connection *, int, void *);
+
+// Pass an event to the request's callback, as if the connection were its own
+static void http_pool_forward(struct ns_connection *nc,
+                              struct http_pool_req *req, int ev, void *p) {
+  void *user_data = nc->user_data;
+  nc->user_data = req->user_data;
+  req->cb(nc, ev, p);
+  nc->user_data = user_data;
+}
+
+static struct http_pool_conn *http_pool_get_conn(struct http_pool_host *host) {
+  struct ns_http_pool *pool = host->pool;
+  struct http_pool_conn *pc;
+
+  for (pc = host->conns; pc != NULL; pc = pc->next) {
+    unsigned int closing = NSF_CLOSE_IMMEDIATELY | NSF_FINISHED_SENDING_DATA;
+    if (pc->req == NULL && !(pc->nc->flags & closing)) return pc;
+  }
+
+  if (host->num_conns >= pool->max_conns_per_host ||
+      (pc = (struct http_pool_conn *) NS_MALLOC(sizeof(*pc))) == NULL) {
+    return NULL;
+  }
+  memset(pc, 0, sizeof(*pc));
+  if ((pc->nc = ns_connect_http(pool->mgr, host->addr, http_pool_handler,
+                                pc)) == NULL) {
+    NS_FREE(pc);
+    return NULL;
+  }
+  pc->host = host;
+  pc->next = host->conns;
+  host->conns = pc;
+  host->num_conns++;
+
+  return pc;
+}
+
+// Hand queued requests to idle connections, opening new ones up to the limit
+static void http_pool_dispatch(struct http_pool_host *host) {
+  struct http_pool_conn *pc;
+  struct http_pool_req *req;
+
+  while ((req = host->queue) != NULL && (pc = http_pool_get_conn(host))) {
+    if ((host->queue = req->next) == NULL) host->queue_tail = NULL;
+    req->next = NULL;
+    pc->req = req;
+    ns_set_timer_ms(pc->nc, 0);
+    ns_send(pc->nc, req->buf, (int) req->len);
+  }
+}
+
+static int http_pool_keep_alive(struct http_message *hm) {
+  struct ns_str *conn = get_http_header(hm, "Connection");
+
+  // In a reply, the protocol version is parsed into the method field
+  if (ns_vcmp(&hm->method, "HTTP/1.1") == 0) {
+    return conn == NULL || ns_vcasecmp(conn, "close") != 0;
+  }
+  return conn != NULL && ns_vcasecmp(conn, "keep-alive") == 0;
+}
+
+// Only these may be sent again when the connection drops without a reply:
+// the server may have acted on any other request already. RFC 7231 4.2.2.
+static int http_pool_idempotent(const struct http_pool_req *req) {
+  static const char *methods[] = {
+    "GET ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", NULL
+  };
+  size_t i, n;
+
+  for (i = 0; methods[i] != NULL; i++) {
+    n = strlen(methods[i]);
+    if (req->len > n && memcmp(req->buf, methods[i], n) == 0) return 1;
+  }
+  return 0;
+}
+
+static void http_pool_unlink(struct http_pool_conn *pc) {
+  struct http_pool_conn **p = &pc->host->conns;
+
+  while (*p != pc) p = &(*p)->next;
+  *p = pc->next;
+  pc->host->num_conns--;
+}
+
+static void http_pool_handler(struct ns_connection *nc, int ev, void *p) {
+  struct http_pool_conn *pc = (struct http_pool_conn *) nc->user_data;
+  struct iobuf *io = &nc->recv_iobuf;
+  struct http_pool_host *host;
+  struct http_pool_req *req;
+  struct http_message hm;
+  int len, num_reqs;
+
+  if (pc == NULL) return;  // Connection outlived its pool
+  host = pc->host;
+  req = pc->req;
+
+  switch (ev) {
+    case NS_HTTP_REPLY:
+      // Interim 1xx replies are not passed on, the request stays in flight
+      // and the connection busy until the final reply
+      if (req == NULL || http_reply_is_interim((struct http_message *) p)) {
+        break;
+      }
+      http_pool_forward(nc, req, ev, p);
+      pc->req = NULL;
+      pc->num_reqs++;
+      NS_FREE(req);
+      if (!http_pool_keep_alive((struct http_message *) p)) {
+        nc->flags |= NSF_FINISHED_SENDING_DATA;
+      } else if (!(nc->flags & NSF_CLOSE_IMMEDIATELY)) {
+        if (host->pool->idle_timeout > 0) {
+          ns_set_timer_ms(nc, nc->mgr->now_ms +
+                          host->pool->idle_timeout * 1000);
+        }
+        http_pool_dispatch(host);
+      }
+      break;
+
+    case NS_RECV:
+      if (req == NULL) break;
+      http_pool_forward(nc, req, ev, p);
+      // Reply to HEAD ends with the headers, whatever Content-Length says.
+      // http_handler() can't know that, so finish the request here, past
+      // any interim replies before it.
+      num_reqs = pc->num_reqs;
+      if (req->len > 5 && memcmp(req->buf, "HEAD ", 5) == 0) {
+        while (pc->num_reqs == num_reqs &&
+               (len = parse_http(io->buf, io->len, &hm)) > 0) {
+          hm.message.len = len;
+          hm.body.len = 0;
+          http_pool_handler(nc, NS_HTTP_REPLY, &hm);
+          iobuf_remove(io, len);
+        }
+      }
+      break;
+
+    case NS_TIMER:
+      if (req == NULL) nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      break;
+
+    case NS_CLOSE:
+      if (req != NULL && io->len > 0 && parse_http(io->buf, io->len, &hm) > 0) {
+        // Reply delimited by the end of the connection
+        hm.body.len = io->buf + io->len - hm.body.p;
+        http_pool_forward(nc, req, NS_HTTP_REPLY, &hm);
+        NS_FREE(req);
+      } else if (req != NULL && pc->num_reqs > 0 && io->len == 0 &&
+                 !req->retried && http_pool_idempotent(req)) {
+        // Server has dropped a kept-alive connection just as we reused it.
+        // Nothing was answered, so the request goes first in line again.
+        req->retried = 1;
+        if ((req->next = host->queue) == NULL) host->queue_tail = req;
+        host->queue = req;
+      } else if (req != NULL) {
+        http_pool_forward(nc, req, ev, p);
+        NS_FREE(req);
+      }
+      io->len = 0;  // Already delivered, or not ours to deliver
+      nc->user_data = NULL;
+      http_pool_unlink(pc);
+      NS_FREE(pc);
+      http_pool_dispatch(host);
+      break;
+
+    default:
+      if (req != NULL) http_pool_forward(nc, req, ev, p);
+      break;
+  }
+}
+
+struct ns_http_pool *ns_http_pool_new(struct ns_mgr *mgr, int max_per_host,
+                                      int idle_timeout) {
+  struct ns_http_pool *pool;
+
+  if ((pool = (struct ns_http_pool *) NS_MALLOC(sizeof(*pool))) != NULL) {
+    memset(pool, 0, sizeof(*pool));
+    pool->mgr = mgr;
+    pool->max_conns_per_host = max_per_host > 0 ? max_per_host : 1;
+    pool->idle_timeout = idle_timeout;
+  }
+  return pool;
+}
+
+int ns_http_pool_request(struct ns_http_pool *pool, const char *addr,
+                         ns_callback_t cb, void *user_data,
+                         const char *fmt, ...) {
+  char mem[500], *buf = mem;
+  struct http_pool_host *host;
+  struct http_pool_req *req = NULL;
+  va_list ap;
+  int len;
+
+  for (host = pool->hosts; host != NULL; host = host->next) {
+    if (strcmp(host->addr, addr) == 0) break;
+  }
+  if (host == NULL) {
+    if (strlen(addr) >= sizeof(host->addr) ||
+        (host = (struct http_pool_host *) NS_MALLOC(sizeof(*host))) == NULL) {
+      return -1;
+    }
+    memset(host, 0, sizeof(*host));
+    strcpy(host->addr, addr);
+    host->pool = pool;
+    host->next = pool->hosts;
+    pool->hosts = host;
+  }
+
+  va_start(ap, fmt);
+  len = ns_avprintf(&buf, sizeof(mem), fmt, ap);
+  va_end(ap);
+
+  if (len >= 0 && (req = (struct http_pool_req *)
+                   NS_MALLOC(sizeof(*req) + len)) != NULL) {
+    req->next = NULL;
+    req->cb = cb;
+    req->user_data = user_data;
+    req->retried = 0;
+    req->len = len;
+    memcpy(req->buf, buf, len);
+  }
+  if (buf != mem && buf != NULL) {
+    free(buf);
+  }
+  if (req == NULL) return -1;
+
+  if (host->queue_tail != NULL) {
+    host->queue_tail->next = req;
+  } else {
+    host->queue = req;
+  }
+  host->queue_tail = req;
+  http_pool_dispatch(host);
+
+  // No connection to this host could be made, so nobody will serve it
+  if (host->num_conns == 0) {
+    struct http_pool_req *prev = NULL, *r;
+    for (r = host->queue; r != req; r = r->next) prev = r;
+    if (prev == NULL) {
+      host->queue = NULL;
+    } else {
+      prev->next = NULL;
+    }
+    host->queue_tail = prev;
+    NS_FREE(req);
+    return -1;
+  }
+
+  return 0;
+}
+
+void ns_http_pool_free(struct ns_http_pool *pool) {
+  struct http_pool_host *host, *next_host;
+  struct http_pool_conn *pc, *next_pc;
+  struct http_pool_req *req, *next_req;
+
+  if (pool == NULL) return;
+
+  for (host = pool->hosts; host != NULL; host = next_host) {
+    next_host = host->next;
+    for (pc = host->conns; pc != NULL; pc = next_pc) {
+      next_pc = pc->next;
+      pc->nc->user_data = NULL;
+      pc->nc->flags |= NSF_CLOSE_IMMEDIATELY;
+      NS_FREE(pc->req);
+      NS_FREE(pc);
+    }
+    for (req = host->queue; req != NULL; req = next_req) {
+      next_req = req->next;
+      NS_FREE(req);
+    }
+    NS_FREE(host);
+  }
+  NS_FREE(pool);
+}
+
 void ns_send_http_file(struct ns_connection *nc, const char *path,
                        ns_stat_t *st) {
   char buf[BUFSIZ];
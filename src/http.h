@@ -42,6 +42,7 @@ struct websocket_message {
 #define NS_WEBSOCKET_HANDSHAKE_DONE     112   // NULL
 #define NS_WEBSOCKET_FRAME              113   // struct websocket_message *
 #define NS_WEBSOCKET_NOT_SUPPORTED      114   // NULL
+#define NS_WEBSOCKET_CONTROL_FRAME      115   // struct websocket_message *
 
 struct ns_connection *ns_bind_http(struct ns_mgr *mgr, const char *addr,
                                    ns_callback_t cb, void *user_data);
@@ -55,6 +56,19 @@ struct ns_connection *ns_connect_websocket(struct ns_mgr *mgr, const char *addr,
 
 void ns_send_websocket(struct ns_connection *, int op, const void *, size_t);
 void ns_printf_websocket(struct ns_connection *, int op, const char *, ...);
+void ns_set_websocket_keepalive(struct ns_connection *, int interval,
+                                int max_missed_pongs);
+
+// Pool of client connections, reused for requests to the same address.
+// Requests above max_conns_per_host wait in a queue. Idle connections are
+// closed after idle_timeout seconds, or kept until the server closes them if
+// idle_timeout is 0. Must be freed before the manager.
+struct ns_http_pool *ns_http_pool_new(struct ns_mgr *, int max_conns_per_host,
+                                      int idle_timeout);
+void ns_http_pool_free(struct ns_http_pool *);
+int ns_http_pool_request(struct ns_http_pool *, const char *addr,
+                         ns_callback_t cb, void *user_data,
+                         const char *fmt, ...);
 
 // Websocket opcodes, from http://tools.ietf.org/html/rfc6455
 #define WEBSOCKET_OP_CONTINUE  0
@@ -4,77 +4,265 @@
 #include <string.h>
 #include "sha1.h"
 
-static int is_big_endian(void) {
-  static const int n = 1;
-  return ((char *) &n)[0] == 0;
-}
-
-#define SHA1HANDSOFF
-#if defined(__sun)
-#include "solarisfixes.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(NS_DISABLE_SHA1_SIMD)
+#define NS_SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
 #endif
 
-union char64long16 { unsigned char c[64]; uint32_t l[16]; };
-
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
-static uint32_t blk0(union char64long16 *block, int i) {
-  // Forrest: SHA expect BIG_ENDIAN, swap if LITTLE_ENDIAN
-  if (!is_big_endian()) {
-    block->l[i] = (rol(block->l[i], 24) & 0xFF00FF00) |
-      (rol(block->l[i], 8) & 0x00FF00FF);
-  }
-  return block->l[i];
-}
+// SHA1 words are big endian. Compilers turn this into a single load+bswap.
+#define load_be32(p) (((uint32_t) (p)[0] << 24) | ((uint32_t) (p)[1] << 16) | \
+                      ((uint32_t) (p)[2] << 8) | (uint32_t) (p)[3])
 
-#define blk(i) (block->l[i&15] = rol(block->l[(i+13)&15]^block->l[(i+8)&15] \
-    ^block->l[(i+2)&15]^block->l[i&15],1))
-#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(block, i)+0x5A827999+rol(v,5);w=rol(w,30);
+#define blk0(i) (block[i] = load_be32(buffer + (i) * 4))
+#define blk(i) (block[i&15] = rol(block[(i+13)&15]^block[(i+8)&15] \
+    ^block[(i+2)&15]^block[i&15],1))
+#define R0(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk0(i)+0x5A827999+rol(v,5);w=rol(w,30);
 #define R1(v,w,x,y,z,i) z+=((w&(x^y))^y)+blk(i)+0x5A827999+rol(v,5);w=rol(w,30);
 #define R2(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
 #define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
 #define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
 
-void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]) {
-  uint32_t a, b, c, d, e;
-  union char64long16 block[1];
-
-  memcpy(block, buffer, 64);
-  a = state[0];
-  b = state[1];
-  c = state[2];
-  d = state[3];
-  e = state[4];
-  R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3);
-  R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7);
-  R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11);
-  R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15);
-  R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19);
-  R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23);
-  R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27);
-  R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31);
-  R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35);
-  R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39);
-  R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43);
-  R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47);
-  R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51);
-  R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55);
-  R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59);
-  R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63);
-  R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67);
-  R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71);
-  R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75);
+// All 80 rounds, four per line. Message words are supplied by the round
+// macros. S(g) runs before rounds g * 4 .. g * 4 + 3 and can be used to
+// compute message words for the rounds that follow.
+#define SHA1_80_ROUNDS(R0, R1, R2, R3, R4, S) \
+  S(0); \
+  R0(a,b,c,d,e, 0); R0(e,a,b,c,d, 1); R0(d,e,a,b,c, 2); R0(c,d,e,a,b, 3); \
+  S(1); \
+  R0(b,c,d,e,a, 4); R0(a,b,c,d,e, 5); R0(e,a,b,c,d, 6); R0(d,e,a,b,c, 7); \
+  S(2); \
+  R0(c,d,e,a,b, 8); R0(b,c,d,e,a, 9); R0(a,b,c,d,e,10); R0(e,a,b,c,d,11); \
+  S(3); \
+  R0(d,e,a,b,c,12); R0(c,d,e,a,b,13); R0(b,c,d,e,a,14); R0(a,b,c,d,e,15); \
+  S(4); \
+  R1(e,a,b,c,d,16); R1(d,e,a,b,c,17); R1(c,d,e,a,b,18); R1(b,c,d,e,a,19); \
+  S(5); \
+  R2(a,b,c,d,e,20); R2(e,a,b,c,d,21); R2(d,e,a,b,c,22); R2(c,d,e,a,b,23); \
+  S(6); \
+  R2(b,c,d,e,a,24); R2(a,b,c,d,e,25); R2(e,a,b,c,d,26); R2(d,e,a,b,c,27); \
+  S(7); \
+  R2(c,d,e,a,b,28); R2(b,c,d,e,a,29); R2(a,b,c,d,e,30); R2(e,a,b,c,d,31); \
+  S(8); \
+  R2(d,e,a,b,c,32); R2(c,d,e,a,b,33); R2(b,c,d,e,a,34); R2(a,b,c,d,e,35); \
+  S(9); \
+  R2(e,a,b,c,d,36); R2(d,e,a,b,c,37); R2(c,d,e,a,b,38); R2(b,c,d,e,a,39); \
+  S(10); \
+  R3(a,b,c,d,e,40); R3(e,a,b,c,d,41); R3(d,e,a,b,c,42); R3(c,d,e,a,b,43); \
+  S(11); \
+  R3(b,c,d,e,a,44); R3(a,b,c,d,e,45); R3(e,a,b,c,d,46); R3(d,e,a,b,c,47); \
+  S(12); \
+  R3(c,d,e,a,b,48); R3(b,c,d,e,a,49); R3(a,b,c,d,e,50); R3(e,a,b,c,d,51); \
+  S(13); \
+  R3(d,e,a,b,c,52); R3(c,d,e,a,b,53); R3(b,c,d,e,a,54); R3(a,b,c,d,e,55); \
+  S(14); \
+  R3(e,a,b,c,d,56); R3(d,e,a,b,c,57); R3(c,d,e,a,b,58); R3(b,c,d,e,a,59); \
+  S(15); \
+  R4(a,b,c,d,e,60); R4(e,a,b,c,d,61); R4(d,e,a,b,c,62); R4(c,d,e,a,b,63); \
+  S(16); \
+  R4(b,c,d,e,a,64); R4(a,b,c,d,e,65); R4(e,a,b,c,d,66); R4(d,e,a,b,c,67); \
+  S(17); \
+  R4(c,d,e,a,b,68); R4(b,c,d,e,a,69); R4(a,b,c,d,e,70); R4(e,a,b,c,d,71); \
+  S(18); \
+  R4(d,e,a,b,c,72); R4(c,d,e,a,b,73); R4(b,c,d,e,a,74); R4(a,b,c,d,e,75); \
+  S(19); \
   R4(e,a,b,c,d,76); R4(d,e,a,b,c,77); R4(c,d,e,a,b,78); R4(b,c,d,e,a,79);
-  state[0] += a;
-  state[1] += b;
-  state[2] += c;
-  state[3] += d;
-  state[4] += e;
-  // Erase working structures. The order of operations is important,
-  // used to ensure that compiler doesn't optimize those out.
-  memset(block, 0, sizeof(block));
-  a = b = c = d = e = 0;
-  (void) a; (void) b; (void) c; (void) d; (void) e;
+
+#define SHA1_NO_SCHEDULE(g)
+
+// Reference implementation, runs everywhere
+static void sha1_blocks_scalar(uint32_t state[5], const unsigned char *buffer,
+                               size_t num_blocks) {
+  uint32_t a, b, c, d, e, block[16];
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    SHA1_80_ROUNDS(R0, R1, R2, R3, R4, SHA1_NO_SCHEDULE);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#ifdef NS_SHA1_X86
+static int sha1_cpu_has_ssse3(void) {
+  unsigned int a, b, c, d;
+  return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3);
+}
+
+static int sha1_cpu_has_shani(void) {
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSSE3) ||
+      !(c & bit_SSE4_1) || __get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  return (b >> 29) & 1;  // CPUID.(EAX=7,ECX=0):EBX.SHA[bit 29]
+}
+
+// Rounds that take message words with constants added from wk[]
+#define P1(v,w,x,y,z,i) z+=((w&(x^y))^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define P2(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+#define P3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+wk[i]+rol(v,5);w=rol(w,30);
+#define P4(v,w,x,y,z,i) z+=(w^x^y)+wk[i]+rol(v,5);w=rol(w,30);
+
+// Compute message words for rounds (g + 4) * 4 .. (g + 4) * 4 + 3, while
+// the rounds g * 4 .. g * 4 + 3 are running. w[t + 3] depends on w[t],
+// which is computed here too: compute it with w[t] taken as zero, then mix
+// in rol(w[t], 1) separately.
+#define SHA1_SSSE3_SCHEDULE(g) if (g < 16) {                                \
+  x = _mm_xor_si128(w0, _mm_alignr_epi8(w1, w0, 8));                        \
+  x = _mm_xor_si128(x, w2);                                                 \
+  x = _mm_xor_si128(x, _mm_srli_si128(w3, 4));                              \
+  x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));            \
+  y = _mm_slli_si128(x, 12);                                                \
+  y = _mm_or_si128(_mm_slli_epi32(y, 1), _mm_srli_epi32(y, 31));            \
+  x = _mm_xor_si128(x, y);                                                  \
+  _mm_storeu_si128((__m128i *) &wk[(g + 4) * 4],                            \
+                   _mm_add_epi32(x, k[(g + 4) / 5]));                       \
+  w0 = w1; w1 = w2; w2 = w3; w3 = x;                                        \
+}
+
+// SSSE3: byte swap and message schedule are done four words at a time,
+// interleaved with the scalar rounds.
+__attribute__((target("ssse3")))
+static void sha1_blocks_ssse3(uint32_t state[5], const unsigned char *buffer,
+                              size_t num_blocks) {
+  const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                     4, 5, 6, 7, 0, 1, 2, 3);
+  const __m128i k[4] = {
+    _mm_set1_epi32(0x5A827999), _mm_set1_epi32(0x6ED9EBA1),
+    _mm_set1_epi32((int) 0x8F1BBCDC), _mm_set1_epi32((int) 0xCA62C1D6)
+  };
+  uint32_t wk[80], a, b, c, d, e;
+  __m128i w0, w1, w2, w3, x, y;
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    // w0..w3 hold the last 16 message words
+    w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) buffer), bswap);
+    w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 16)),
+                          bswap);
+    w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 32)),
+                          bswap);
+    w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (buffer + 48)),
+                          bswap);
+    _mm_storeu_si128((__m128i *) &wk[0], _mm_add_epi32(w0, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[4], _mm_add_epi32(w1, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[8], _mm_add_epi32(w2, k[0]));
+    _mm_storeu_si128((__m128i *) &wk[12], _mm_add_epi32(w3, k[0]));
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    SHA1_80_ROUNDS(P1, P1, P2, P3, P4, SHA1_SSSE3_SCHEDULE);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+// Four rounds k * 4 .. k * 4 + 3 with SHA extensions. m[k % 4] holds
+// message words for these rounds, while words for the following rounds
+// are being computed in the other three registers.
+#define SHA1_NI_QUAD(k, f) do {                                              \
+  if (k > 0) e = _mm_sha1nexte_epu32(e_prev, m[k % 4]);                      \
+  e_prev = abcd;                                                             \
+  if (k >= 3 && k <= 18)                                                     \
+    m[(k + 1) % 4] = _mm_sha1msg2_epu32(m[(k + 1) % 4], m[k % 4]);           \
+  abcd = _mm_sha1rnds4_epu32(abcd, e, f);                                    \
+  if (k >= 1 && k <= 16)                                                     \
+    m[(k + 3) % 4] = _mm_sha1msg1_epu32(m[(k + 3) % 4], m[k % 4]);           \
+  if (k >= 2 && k <= 17)                                                     \
+    m[(k + 2) % 4] = _mm_xor_si128(m[(k + 2) % 4], m[k % 4]);                \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_blocks_shani(uint32_t state[5], const unsigned char *buffer,
+                              size_t num_blocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e, e_save, e_prev, m[4];
+  int i;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+  e = _mm_set_epi32((int) state[4], 0, 0, 0);
+
+  for (; num_blocks > 0; num_blocks--, buffer += 64) {
+    abcd_save = abcd;
+    e_save = e;
+    for (i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *) (buffer + i * 16)), bswap);
+    }
+    e = _mm_add_epi32(e, m[0]);
+
+    SHA1_NI_QUAD(0, 0);  SHA1_NI_QUAD(1, 0);  SHA1_NI_QUAD(2, 0);
+    SHA1_NI_QUAD(3, 0);  SHA1_NI_QUAD(4, 0);  SHA1_NI_QUAD(5, 1);
+    SHA1_NI_QUAD(6, 1);  SHA1_NI_QUAD(7, 1);  SHA1_NI_QUAD(8, 1);
+    SHA1_NI_QUAD(9, 1);  SHA1_NI_QUAD(10, 2); SHA1_NI_QUAD(11, 2);
+    SHA1_NI_QUAD(12, 2); SHA1_NI_QUAD(13, 2); SHA1_NI_QUAD(14, 2);
+    SHA1_NI_QUAD(15, 3); SHA1_NI_QUAD(16, 3); SHA1_NI_QUAD(17, 3);
+    SHA1_NI_QUAD(18, 3); SHA1_NI_QUAD(19, 3);
+
+    e = _mm_sha1nexte_epu32(e_prev, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = (uint32_t) _mm_extract_epi32(e, 3);
+}
+#endif  // NS_SHA1_X86
+
+typedef void (*sha1_blocks_t)(uint32_t state[5], const unsigned char *,
+                              size_t num_blocks);
+
+// Available implementations, fastest first
+static const struct {
+  const char *name;
+  int (*is_supported)(void);
+  sha1_blocks_t blocks;
+} s_sha1_impls[] = {
+#ifdef NS_SHA1_X86
+  { "sha-ni", sha1_cpu_has_shani, sha1_blocks_shani },
+  { "ssse3", sha1_cpu_has_ssse3, sha1_blocks_ssse3 },
+#endif
+  { "scalar", NULL, sha1_blocks_scalar }
+};
+
+static sha1_blocks_t s_sha1_blocks = NULL;
+
+// Pick the fastest implementation the CPU supports, on first use
+static void sha1_blocks(uint32_t state[5], const unsigned char *buffer,
+                        size_t num_blocks) {
+  size_t i;
+
+  if (s_sha1_blocks == NULL) {
+    for (i = 0; i < ARRAY_SIZE(s_sha1_impls); i++) {
+      if (s_sha1_impls[i].is_supported == NULL ||
+          s_sha1_impls[i].is_supported()) {
+        s_sha1_blocks = s_sha1_impls[i].blocks;
+        break;
+      }
+    }
+  }
+  s_sha1_blocks(state, buffer, num_blocks);
+}
+
+void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]) {
+  sha1_blocks(state, buffer, 1);
 }
 
 void SHA1Init(SHA1_CTX *context) {
@@ -96,10 +284,9 @@ void SHA1Update(SHA1_CTX *context, const unsigned char *data, uint32_t len) {
   j = (j >> 3) & 63;
   if ((j + len) > 63) {
     memcpy(&context->buffer[j], data, (i = 64-j));
-    SHA1Transform(context->state, context->buffer);
-    for ( ; i + 63 < len; i += 64) {
-      SHA1Transform(context->state, &data[i]);
-    }
+    sha1_blocks(context->state, context->buffer, 1);
+    sha1_blocks(context->state, &data[i], (len - i) / 64);
+    i += (len - i) & ~63;
     j = 0;
   }
   else i = 0;
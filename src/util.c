@@ -38,29 +38,230 @@ int ns_vcmp(const struct ns_str *str2, const char *str1) {
   return n1 == n2 ? memcmp(str1, str2->p, n2) : n1 > n2 ? 1 : -1;
 }
 
-void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
-  static const char *b64 =
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  !defined(NS_DISABLE_BASE64_SIMD)
+#define NS_BASE64_X86
+#include <immintrin.h>
+
+// SIMD level supported by the CPU: -1 not checked yet, 0 none, 1 SSSE3,
+// 2 AVX2
+static int s_base64_simd = -1;
+
+static int base64_simd_level(void) {
+  if (s_base64_simd < 0) {
+    __builtin_cpu_init();
+    s_base64_simd = __builtin_cpu_supports("avx2") ? 2 :
+      __builtin_cpu_supports("ssse3") ? 1 : 0;
+  }
+  return s_base64_simd;
+}
+
+// Encoding and decoding below follow Wojciech Mula's SIMD base64 algorithms,
+// http://0x80.pl/articles/index.html#base64-algorithm-new
+
+// Spread 12 bytes, 3 in each 32-bit lane, into 16 6-bit indices
+#define B64_ENC_RESHUFFLE(in, shuffle, and_si, mulhi_epu16, mullo_epi16,   \
+                          or_si, set1_epi32, set_epi8)                     \
+  or_si(mulhi_epu16(and_si(shuffle(in, set_epi8(10, 11, 9, 10, 7, 8, 6, 7, \
+          4, 5, 3, 4, 1, 2, 0, 1)), set1_epi32(0x0fc0fc00)),               \
+          set1_epi32(0x04000040)),                                         \
+        mullo_epi16(and_si(shuffle(in, set_epi8(10, 11, 9, 10, 7, 8, 6, 7, \
+          4, 5, 3, 4, 1, 2, 0, 1)), set1_epi32(0x003f03f0)),               \
+          set1_epi32(0x01000010)))
+
+// Offsets that turn 6-bit indices into ASCII, selected by index range
+#define B64_ENC_OFFSETS(setr_epi8, url_safe) setr_epi8(                   \
+  'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,    \
+  '0' - 52, '0' - 52, '0' - 52, '0' - 52,                                  \
+  url_safe ? '-' - 62 : '+' - 62, url_safe ? '_' - 63 : '/' - 63, 'A', 0, 0)
+
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(const unsigned char *src, int len, char *dst,
+                               int url_safe) {
+  const __m128i offsets = B64_ENC_OFFSETS(_mm_setr_epi8, url_safe);
+  __m128i in, idx, res;
+  int i;
+
+  // Each step loads 16 bytes but consumes only 12
+  for (i = 0; i + 16 <= len; i += 12, dst += 16) {
+    in = _mm_loadu_si128((const __m128i *) (src + i));
+    idx = B64_ENC_RESHUFFLE(in, _mm_shuffle_epi8, _mm_and_si128,
+                            _mm_mulhi_epu16, _mm_mullo_epi16, _mm_or_si128,
+                            _mm_set1_epi32, _mm_set_epi8);
+    res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),
+                                                         idx),
+                                          _mm_set1_epi8(13)));
+    res = _mm_add_epi8(_mm_shuffle_epi8(offsets, res), idx);
+    _mm_storeu_si128((__m128i *) dst, res);
+  }
+
+  return i;
+}
+
+#define _mm256_set_epi8x2(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+  _mm256_set_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p,          \
+                  a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+#define _mm256_setr_epi8x2(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+  _mm256_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p,         \
+                   a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+__attribute__((target("avx2")))
+static int base64_encode_avx2(const unsigned char *src, int len, char *dst,
+                              int url_safe) {
+  const __m256i offsets = B64_ENC_OFFSETS(_mm256_setr_epi8x2, url_safe);
+  __m256i in, idx, res;
+  int i;
+
+  // Bytes 0..11 go to the low lane, bytes 12..23 to the high lane
+  for (i = 0; i + 28 <= len; i += 24, dst += 32) {
+    in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i *) (src + i))),
+        _mm_loadu_si128((const __m128i *) (src + i + 12)), 1);
+    idx = B64_ENC_RESHUFFLE(in, _mm256_shuffle_epi8, _mm256_and_si256,
+                            _mm256_mulhi_epu16, _mm256_mullo_epi16,
+                            _mm256_or_si256, _mm256_set1_epi32,
+                            _mm256_set_epi8x2);
+    res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    res = _mm256_or_si256(res, _mm256_and_si256(
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), _mm256_set1_epi8(13)));
+    res = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, res), idx);
+    _mm256_storeu_si256((__m256i *) dst, res);
+  }
+
+  return i + base64_encode_ssse3(src + i, len - i, dst, url_safe);
+}
+
+// Validation and translation tables for the standard alphabet, indexed
+// by low and high nibbles of the input characters
+#define B64_DEC_LUT_LO(setr_epi8) setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, \
+  0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a)
+#define B64_DEC_LUT_HI(setr_epi8) setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, \
+  0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10)
+#define B64_DEC_LUT_ROLL(setr_epi8) setr_epi8(0, 16, 19, 4, -65, -65, -71, \
+  -71, 0, 0, 0, 0, 0, 0, 0, 0)
+
+// Decode 16 characters per step, stop at the first block that has
+// anything but the standard alphabet in it (including padding). The
+// caller must provide at least 4 bytes of extra room in dst.
+__attribute__((target("ssse3")))
+static int base64_decode_ssse3(const unsigned char *src, int len, char *dst) {
+  const __m128i lut_lo = B64_DEC_LUT_LO(_mm_setr_epi8);
+  const __m128i lut_hi = B64_DEC_LUT_HI(_mm_setr_epi8);
+  const __m128i lut_roll = B64_DEC_LUT_ROLL(_mm_setr_epi8);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i str, hi_nibbles, lo_nibbles, eq_2f;
+  int i;
+
+  for (i = 0; i + 16 <= len; i += 16, dst += 12) {
+    str = _mm_loadu_si128((const __m128i *) (src + i));
+    hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm_and_si128(str, mask_2f);
+    if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(
+        _mm_shuffle_epi8(lut_lo, lo_nibbles),
+        _mm_shuffle_epi8(lut_hi, hi_nibbles)), _mm_setzero_si128())) != 0) {
+      break;
+    }
+    eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+    str = _mm_add_epi8(str, _mm_shuffle_epi8(lut_roll,
+                                             _mm_add_epi8(eq_2f, hi_nibbles)));
+    str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+    str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+    str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                              14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *) dst, str);
+  }
+
+  return i;
+}
+
+// Same as above, 32 characters per step. Needs 8 bytes of extra room.
+__attribute__((target("avx2")))
+static int base64_decode_avx2(const unsigned char *src, int len, char *dst) {
+  const __m256i lut_lo = B64_DEC_LUT_LO(_mm256_setr_epi8x2);
+  const __m256i lut_hi = B64_DEC_LUT_HI(_mm256_setr_epi8x2);
+  const __m256i lut_roll = B64_DEC_LUT_ROLL(_mm256_setr_epi8x2);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  __m256i str, hi_nibbles, lo_nibbles, eq_2f;
+  int i;
+
+  for (i = 0; i + 32 <= len; i += 32, dst += 24) {
+    str = _mm256_loadu_si256((const __m256i *) (src + i));
+    hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    lo_nibbles = _mm256_and_si256(str, mask_2f);
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(
+        _mm256_shuffle_epi8(lut_lo, lo_nibbles),
+        _mm256_shuffle_epi8(lut_hi, hi_nibbles)),
+        _mm256_setzero_si256())) != 0) {
+      break;
+    }
+    eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll,
+        _mm256_add_epi8(eq_2f, hi_nibbles)));
+    str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, _mm256_setr_epi8x2(2, 1, 0, 6, 5, 4, 10,
+                                                      9, 8, 14, 13, 12, -1,
+                                                      -1, -1, -1));
+    // Each lane holds 12 bytes of output, make them contiguous
+    str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5,
+                                                             6, 7, 7));
+    _mm256_storeu_si256((__m256i *) dst, str);
+  }
+
+  return i + base64_decode_ssse3(src + i, len - i, dst);
+}
+#endif  // NS_BASE64_X86
+
+// Encode src_len bytes of src into dst, which must have space for
+// NS_BASE64_ENCODED_SIZE(src_len) bytes. Flags are NS_BASE64_* bitmask.
+// Return length of the encoded, NUL-terminated string.
+int ns_base64_encode2(const unsigned char *src, int src_len, char *dst,
+                      int flags) {
+  const char *b64 = flags & NS_BASE64_URL_SAFE ?
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_" :
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-  int i, j, a, b, c;
+  int i = 0, j = 0, a, b, c;
 
-  for (i = j = 0; i < src_len; i += 3) {
+#ifdef NS_BASE64_X86
+  switch (base64_simd_level()) {
+    case 2: i = base64_encode_avx2(src, src_len, dst,
+                                   flags & NS_BASE64_URL_SAFE); break;
+    case 1: i = base64_encode_ssse3(src, src_len, dst,
+                                    flags & NS_BASE64_URL_SAFE); break;
+  }
+  j = i / 3 * 4;
+#endif
+
+  for (; i + 3 <= src_len; i += 3) {
     a = src[i];
-    b = i + 1 >= src_len ? 0 : src[i + 1];
-    c = i + 2 >= src_len ? 0 : src[i + 2];
+    b = src[i + 1];
+    c = src[i + 2];
+    dst[j++] = b64[a >> 2];
+    dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
+    dst[j++] = b64[((b & 15) << 2) | (c >> 6)];
+    dst[j++] = b64[c & 63];
+  }
 
+  if (i < src_len) {
+    a = src[i];
+    b = i + 1 < src_len ? src[i + 1] : 0;
     dst[j++] = b64[a >> 2];
     dst[j++] = b64[((a & 3) << 4) | (b >> 4)];
     if (i + 1 < src_len) {
-      dst[j++] = b64[(b & 15) << 2 | (c >> 6)];
+      dst[j++] = b64[(b & 15) << 2];
     }
-    if (i + 2 < src_len) {
-      dst[j++] = b64[c & 63];
+    while (!(flags & NS_BASE64_NO_PADDING) && j % 4 != 0) {
+      dst[j++] = '=';
     }
   }
-  while (j % 4 != 0) {
-    dst[j++] = '=';
-  }
-  dst[j++] = '\0';
+  dst[j] = '\0';
+
+  return j;
+}
+
+void ns_base64_encode(const unsigned char *src, int src_len, char *dst) {
+  ns_base64_encode2(src, src_len, dst, 0);
 }
 
 // Convert one byte of encoded base64 input stream to 6-bit chunk
@@ -84,24 +285,60 @@ static unsigned char from_b64(unsigned char ch) {
      41,  42,  43,  44,  45,  46,  47,  48, //  112
      49,  50,  51, 255, 255, 255, 255, 255, //  120
   };
-  return tab[ch & 127];
+  return ch & 128 ? 255 : tab[ch];
 }
 
-void ns_base64_decode(const unsigned char *s, int len, char *dst) {
+// 6-bit value of the i-th character. End of input counts as padding.
+static unsigned char b64_at(const unsigned char *s, int i, int len,
+                            int flags) {
+  unsigned char ch;
+
+  if (i >= len) return 200;
+  ch = s[i];
+  if (flags & NS_BASE64_URL_SAFE) {
+    if (ch == '-') ch = '+';
+    if (ch == '_') ch = '/';
+  }
+  return from_b64(ch);
+}
+
+// Decode base64 string s of length len into dst, which must have space
+// for NS_BASE64_DECODED_SIZE(len) bytes. Decoding stops at the padding or
+// at the first invalid character. Final quantum may be unpadded. Return
+// number of decoded bytes; dst is NUL-terminated.
+int ns_base64_decode2(const unsigned char *s, int len, char *dst,
+                      int flags) {
   unsigned char a, b, c, d;
-  while (len >= 4 &&
-         (a = from_b64(s[0])) != 255 &&
-         (b = from_b64(s[1])) != 255 &&
-         (c = from_b64(s[2])) != 255 &&
-         (d = from_b64(s[3])) != 255) {
+  int i = 0, n = 0;
+
+#ifdef NS_BASE64_X86
+  if (!(flags & NS_BASE64_URL_SAFE)) {
+    switch (base64_simd_level()) {
+      case 2: i = len >= 48 ? base64_decode_avx2(s, len - 16, dst) : 0; break;
+      case 1: i = len >= 24 ? base64_decode_ssse3(s, len - 8, dst) : 0; break;
+    }
+    n = i / 4 * 3;
+  }
+#endif
+
+  while (i + 1 < len &&
+         (a = b64_at(s, i, len, flags)) != 255 &&
+         (b = b64_at(s, i + 1, len, flags)) != 255 &&
+         (c = b64_at(s, i + 2, len, flags)) != 255 &&
+         (d = b64_at(s, i + 3, len, flags)) != 255) {
     if (a == 200 || b == 200) break;  // '=' can't be there
-    *dst++ = a << 2 | b >> 4;
+    dst[n++] = a << 2 | b >> 4;
     if (c == 200) break;
-    *dst++ = b << 4 | c >> 2;
+    dst[n++] = b << 4 | c >> 2;
     if (d == 200) break;
-    *dst++ = c << 6 | d;
-    s += 4;
-    len -=4;
+    dst[n++] = c << 6 | d;
+    i += 4;
   }
-  *dst = 0;
+  dst[n] = '\0';
+
+  return n;
+}
+
+void ns_base64_decode(const unsigned char *s, int len, char *dst) {
+  ns_base64_decode2(s, len, dst, 0);
 }
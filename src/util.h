@@ -15,6 +15,17 @@ int ns_vcasecmp(const struct ns_str *str2, const char *str1);
 void ns_base64_decode(const unsigned char *s, int len, char *dst);
 void ns_base64_encode(const unsigned char *src, int src_len, char *dst);
 
+#define NS_BASE64_URL_SAFE    1   // Use '-' and '_' instead of '+' and '/'
+#define NS_BASE64_NO_PADDING  2   // Do not append '=' when encoding
+
+// Destination buffer sizes, including the terminating NUL
+#define NS_BASE64_ENCODED_SIZE(n) (((n) + 2) / 3 * 4 + 1)
+#define NS_BASE64_DECODED_SIZE(n) ((n) / 4 * 3 + 3)
+
+int ns_base64_encode2(const unsigned char *src, int src_len, char *dst,
+                      int flags);
+int ns_base64_decode2(const unsigned char *s, int len, char *dst, int flags);
+
 #ifdef __cplusplus
 }
 #endif // __cplusplus
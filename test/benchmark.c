@@ -0,0 +1,100 @@
+// Copyright (c) 2014 Cesanta Software Limited
+// All rights reserved
+//
+// Throughput benchmarks for the hot code paths. Build and run: make bench
+
+#include "../smart.h"
+#include "../smart.c"
+
+#include <sys/time.h>
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void bench_sha1(void) {
+  static unsigned char buf[1024 * 1024];
+  unsigned char digest[20];
+  char key[100];
+  SHA1_CTX ctx;
+  double t, mbps, ops;
+  size_t i;
+  int j;
+
+  for (i = 0; i < sizeof(buf); i++) buf[i] = (unsigned char) i;
+  snprintf(key, sizeof(key), "%s", "dGhlIHNhbXBsZSBub25jZQ=="
+           "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+
+  for (i = 0; i < ARRAY_SIZE(s_sha1_impls); i++) {
+    if (s_sha1_impls[i].is_supported != NULL &&
+        !s_sha1_impls[i].is_supported()) continue;
+    s_sha1_blocks = s_sha1_impls[i].blocks;
+
+    // Bulk data, e.g. integrity checks
+    t = now();
+    for (j = 0; j < 256; j++) {
+      SHA1Init(&ctx);
+      SHA1Update(&ctx, buf, sizeof(buf));
+      SHA1Final(digest, &ctx);
+    }
+    mbps = 256 / (now() - t);
+
+    // Websocket handshake: key + magic, 60 bytes
+    t = now();
+    for (j = 0; j < 1000000; j++) {
+      SHA1Init(&ctx);
+      SHA1Update(&ctx, (unsigned char *) key, strlen(key));
+      SHA1Final(digest, &ctx);
+    }
+    ops = 1000000 / (now() - t);
+
+    printf("sha1 %-8s %8.1f MB/s %10.0f handshakes/s\n",
+           s_sha1_impls[i].name, mbps, ops);
+  }
+  s_sha1_blocks = NULL;
+}
+
+static void bench_base64(void) {
+  static unsigned char buf[1024 * 1024];
+  static char enc[NS_BASE64_ENCODED_SIZE(sizeof(buf))];
+  static char dec[NS_BASE64_DECODED_SIZE(sizeof(enc))];
+  static const char *names[] = {"scalar", "ssse3", "avx2"};
+  double t, enc_mbps, dec_mbps;
+  int i, j, max_level = 0, len = 0;
+
+  for (i = 0; i < (int) sizeof(buf); i++) buf[i] = (unsigned char) (i * 13);
+#ifdef NS_BASE64_X86
+  max_level = base64_simd_level();
+#endif
+
+  for (i = 0; i <= max_level; i++) {
+#ifdef NS_BASE64_X86
+    s_base64_simd = i;
+#endif
+    t = now();
+    for (j = 0; j < 256; j++) {
+      len = ns_base64_encode2(buf, sizeof(buf), enc, 0);
+    }
+    enc_mbps = 256 / (now() - t);
+
+    t = now();
+    for (j = 0; j < 256; j++) {
+      ns_base64_decode2((unsigned char *) enc, len, dec, 0);
+    }
+    dec_mbps = 256 / (now() - t);
+
+    printf("base64 %-8s %8.1f MB/s encode %8.1f MB/s decode\n",
+           names[i], enc_mbps, dec_mbps);
+  }
+#ifdef NS_BASE64_X86
+  s_base64_simd = max_level;
+#endif
+}
+
+int main(void) {
+  bench_sha1();
+  bench_base64();
+  return EXIT_SUCCESS;
+}